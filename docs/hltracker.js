@@ -283,8 +283,10 @@ function fetchJSONFile(path, callback) {
 }
 
 function rankCompare(a, b) {
-	let rankA = g_server_data["servers"][a]["rank"];
-	let rankB = g_server_data["servers"][b]["rank"];
+	// servers are ordered by the tracker's ranking formula. Older data only has player count sums.
+	let key = "score" in g_server_data["servers"][a] ? "score" : "rank";
+	let rankA = g_server_data["servers"][a][key];
+	let rankB = g_server_data["servers"][b][key];
 	
 	if (rankA > rankB) {
 		return -1;
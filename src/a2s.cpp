@@ -6,6 +6,10 @@
 #include <unordered_map>
 #include <thread>
 #include <chrono>
+#include <deque>
+#include <math.h>
+#include <ctype.h>
+#include <algorithm>
 #include "main.h"
 #include "util.h"
 
@@ -22,16 +26,41 @@ typedef int socklen_t;
 #include <fcntl.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
 using namespace std::chrono;
 
 #define MAX_REQ_ATTEMPTS 3 // give up A2S query after this many attempts
 #define REQ_TIMEOUT 1000 // milliseconds to wait between A2S query attempts
+#define A2S_BATCH_SIZE 64 // max packets sent or received per syscall
+#define A2S_MAX_REQ_SIZE 32 // size of the largest request packet
+#define A2S_MAX_PACKET_SIZE 4096 // size of the largest response packet
+#define A2S_MAX_SHARDS 8 // max sockets/threads that servers are split between
+#define A2S_RECV_BUFFER_SIZE (1024*1024) // kernel receive buffer size for each socket
+#define A2S_INITIAL_RATE 5000 // packets per second each shard sends at before adapting
+#define A2S_MIN_RATE 100 // slowest send rate (packets per second)
+#define A2S_MAX_RATE 100000 // fastest send rate (packets per second)
+#define A2S_PACE_INTERVAL 100 // milliseconds between send rate adjustments
+#define A2S_MAX_LOSS 0.05f // extra fraction of requests that can be lost before slowing down
+#define A2S_MAX_DELAY 50 // extra milliseconds responses can be delayed by before slowing down
+#define A2S_MIN_SAMPLES 10 // responses and losses needed to judge an adjustment interval
+#define A2S_MAX_FRAGMENTS 15 // max parts of a split response
+#define A2S_FRAGMENT_POOL_SIZE 128 // split response parts that each shard can hold at once
+#define A2S_MAX_SPLITS 32 // split responses that each shard can reassemble at once
+#define A2S_SPLIT_LIFETIME 2000 // milliseconds to wait for the rest of a split response
+#define A2S_MAX_RTT_SAMPLES 8 // round trip times kept for each server per pass
+#define A2S_WHEEL_SLOTS 256 // timer wheel slots. Must be a power of 2.
+#define A2S_WHEEL_TICK 8 // milliseconds covered by each timer wheel slot
 
 enum QUERY_JOB_STATE {
-    QJ_NOT_STARTED, // no packets have been sent yet
+    QJ_NOT_STARTED, // no player packets have been sent yet
     QJ_WAIT_CHALLENGE, // challenge request sent. Now waiting for a response.
     QJ_GOT_CHALLENGE, // challenge response received.
     QJ_WAIT_PLAYERS, // challenge received. Now waiting for player list.
+    QJ_GET_INFO, // server info is needed before the player list
+    QJ_WAIT_INFO, // info request sent. Now waiting for a response.
     QJ_DONE, // job finished or failed.
 };
 
@@ -40,42 +69,438 @@ struct QueryJob {
     int32_t challenge = 0;
     int state = 0;
     uint64_t lastReq = 0; // time a request was last sent
+    uint64_t lastReqMicros = 0; // same, in microseconds, for round trip times
+    uint32_t reqId = 0; // incremented for every request, so that stale timeouts can be ignored
+    bool responded = false; // true if the server responded to any request this pass
+    bool cachedChallenge = false; // challenge is from a previous pass and hasn't been accepted yet
+    int32_t infoChallenge = 0; // challenge for info requests, if the server wants one
+    A2SInfo info;
+    bool gotInfo = false;
     int reqAttempts; // how many times a request was attempted
-    std::vector<Player> players;
+    uint32_t rtts[A2S_MAX_RTT_SAMPLES]; // round trip times of responses (microseconds)
+    int numRtts = 0;
+    bool timedOut = false; // a request timed out, so later responses may be late replies to it
+    uint32_t firstPlayer = 0; // players are in the shard's player list
+    uint16_t numPlayers = 0;
     bool success = false;
 };
 
-int g_a2s_socket;
+struct ReqTimeout {
+    uint64_t deadline; // time the request times out (ms)
+    uint32_t job;
+    uint32_t reqId;
+};
+
+// Hashed timer wheel for request timeouts. Each slot holds the timeouts with deadlines in one tick,
+// plus any that are whole turns of the wheel later, so adding a timeout costs the same no matter
+// how many are pending, and only the slots that the clock passed are visited. Slot vectors keep
+// their capacity between passes.
+struct TimerWheel {
+    // removes all timeouts and starts the clock at the given time
+    void clear(uint64_t now);
+
+    void add(const ReqTimeout& timeout);
+
+    // moves timeouts with deadlines at or before the given time into expired
+    void expire(uint64_t now, std::vector<ReqTimeout>& expired);
+
+    // earliest deadline, or 0 if there are no timeouts
+    uint64_t nextDeadline() const;
+
+    bool empty() const {
+        return count == 0;
+    }
+
+private:
+    std::vector<ReqTimeout> slots[A2S_WHEEL_SLOTS];
+    uint64_t tick = 0; // slots before this tick were expired
+    size_t count = 0;
+};
+
+struct A2SPacket {
+    sockaddr_in addr;
+    uint8_t* data;
+    int len;
+    uint64_t recvTime; // microseconds. Set by the kernel where supported.
+};
+
+struct A2SFragment {
+    uint8_t data[A2S_MAX_PACKET_SIZE];
+    int len;
+};
+
+// a response that the server split into multiple packets, waiting for the rest of its parts
+struct SplitResponse {
+    uint32_t job;
+    int32_t id; // chosen by the server for each response
+    uint8_t total; // number of parts
+    uint8_t received; // parts received so far
+    uint64_t expireTime; // the parts are dropped if the response isn't complete by this time
+    int16_t parts[A2S_MAX_FRAGMENTS]; // fragment pool index of each part (-1 = not received yet)
+};
+
+struct A2SPassStats {
+    // syscalls, to show how well packets are batched
+    int sendCalls;
+    int packetsSent;
+    int recvCalls;
+    int packetsRecv;
+
+    int responses; // responses to pending requests
+    int timeouts; // requests that timed out
+    int retries; // requests that were sent again
+    int challengeReqs; // challenge requests sent
+    int cachedChallenges; // player requests sent with a challenge from a previous pass
+    int staleChallenges; // cached challenges that the server didn't accept
+    int infoResponses; // servers that sent their info
+    uint32_t kernelDrops; // responses dropped because the socket receive queue was full
+    int splitResponses; // responses joined from multiple packets
+    int fragmentsDropped; // parts of split responses that were dropped
+};
+
+// Servers are split between shards by address. Each shard has its own socket, bound to its own
+// port, and runs its own query loop in a separate thread.
+struct A2SShard {
+    int socket = -1;
+#ifdef __linux__
+    int epoll = -1;
+#endif
+
+    std::vector<QueryJob> jobs;
+    PlayerList players; // players of all jobs, swapped into g_a2sPlayers after the pass
+    std::unordered_map<uint64_t, uint32_t> jobIds;
+    std::deque<uint32_t> sendQueue; // jobs with a request to send
+    TimerWheel timeouts; // sent requests that haven't timed out yet
+    std::vector<ReqTimeout> expired; // timeouts that fired in the current loop
+
+    // Requests are queued then sent together, and responses are received into a ring of buffers
+    // that's reused for every batch.
+    uint8_t sendBuffers[A2S_BATCH_SIZE][A2S_MAX_REQ_SIZE];
+    uint8_t recvBuffers[A2S_BATCH_SIZE][A2S_MAX_PACKET_SIZE];
+    A2SPacket sendBatch[A2S_BATCH_SIZE];
+    A2SPacket recvBatch[A2S_BATCH_SIZE];
+    int sendBatchSize = 0;
+#ifdef __linux__
+    uint8_t recvControl[A2S_BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(timespec))];
+    uint32_t kernelDrops = 0; // receive queue overflows since the socket was opened
+#endif
+
+    // Parts of split responses are copied into a pool of buffers until all of them arrived, then they're
+    // joined into one buffer and handled like any other response.
+    A2SFragment fragments[A2S_FRAGMENT_POOL_SIZE];
+    std::vector<int16_t> freeFragments;
+    SplitResponse splits[A2S_MAX_SPLITS];
+    int numSplits = 0;
+    uint8_t joinBuffer[A2S_MAX_FRAGMENTS * A2S_MAX_PACKET_SIZE];
+
+    // Requests are paced by a token bucket. The rate keeps growing while the bucket holds sends back,
+    // and is cut when the kernel drops responses, or when more requests are lost or responses take
+    // longer than usual, which happens as queues fill up. Servers have very different round trip
+    // times and loss, so only changes in the averages are meaningful.
+    // The rate carries over to the next pass.
+    float sendRate = A2S_INITIAL_RATE; // packets per second
+    float sendTokens = 0;
+    uint64_t lastRefill = 0; // microseconds
+    uint64_t lastAdapt = 0; // milliseconds
+    bool rateLimited = false; // sends were held back since the last adjustment
+    uint64_t lastDecrease = 0; // time of the last rate decrease or the start of the pass (ms)
+    float baseRtt = 0; // lowest average round trip time of an interval this pass (ms)
+    float lastRtt = 0; // average round trip time of the last interval with enough responses (ms)
+    float avgLoss = -1; // moving average of the fraction of requests lost per interval (-1 = unknown)
+    uint64_t intervalRtt = 0; // sum of round trip times since the last adjustment (ms)
+    int intervalResponses = 0; // responses since the last adjustment
+    int intervalLosses = 0; // requests to responsive servers that timed out since the last adjustment
+    uint32_t intervalDrops = 0; // kernel drops as of the last adjustment
+
+    A2SPassStats stats;
+    int wakeups;
+    uint64_t cpuMicros;
+};
+
+std::vector<A2SShard> g_shards;
+std::vector<PlayerList> g_a2sPlayers;
 
-void sendPacket(const sockaddr_in& addr, const std::vector<uint8_t>& packet) {
-    sendto(g_a2s_socket, (const char*)packet.data(), packet.size(), 0,
-        (const sockaddr*)&addr, sizeof(addr));
+// sends all queued packets
+void flushPackets(A2SShard& shard) {
+    if (shard.sendBatchSize == 0) {
+        return;
+    }
+
+#ifdef __linux__
+    mmsghdr msgs[A2S_BATCH_SIZE];
+    iovec iovs[A2S_BATCH_SIZE];
+    memset(msgs, 0, sizeof(mmsghdr) * shard.sendBatchSize);
+
+    for (int i = 0; i < shard.sendBatchSize; i++) {
+        iovs[i].iov_base = shard.sendBatch[i].data;
+        iovs[i].iov_len = shard.sendBatch[i].len;
+        msgs[i].msg_hdr.msg_name = &shard.sendBatch[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // packets that can't be sent are handled like lost packets
+    for (int sent = 0; sent < shard.sendBatchSize; ) {
+        int ret = sendmmsg(shard.socket, msgs + sent, shard.sendBatchSize - sent, 0);
+        shard.stats.sendCalls++;
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+        shard.stats.packetsSent += ret;
+    }
+#else
+    for (int i = 0; i < shard.sendBatchSize; i++) {
+        A2SPacket& packet = shard.sendBatch[i];
+        sendto(shard.socket, (const char*)packet.data, packet.len, 0, (const sockaddr*)&packet.addr, sizeof(sockaddr_in));
+        shard.stats.sendCalls++;
+        shard.stats.packetsSent++;
+    }
+#endif
+
+    shard.sendBatchSize = 0;
+}
+
+void sendPacket(A2SShard& shard, const sockaddr_in& addr, const uint8_t* data, int len) {
+    if (shard.sendBatchSize == A2S_BATCH_SIZE) {
+        flushPackets(shard);
+    }
+
+    A2SPacket& packet = shard.sendBatch[shard.sendBatchSize];
+    packet.addr = addr;
+    packet.data = shard.sendBuffers[shard.sendBatchSize];
+    packet.len = len;
+    memcpy(packet.data, data, len);
+    shard.sendBatchSize++;
 }
 
-std::vector<Player> parsePlayers(std::vector<uint8_t>& data) {
-    size_t i = 5;
-    int numPlayers = data[i++];
-    std::vector<Player> players;
+// receives queued packets into the shard's receive batch. Returns the number of packets received.
+int receivePackets(A2SShard& shard) {
+#ifdef __linux__
+    mmsghdr msgs[A2S_BATCH_SIZE];
+    iovec iovs[A2S_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < A2S_BATCH_SIZE; i++) {
+        iovs[i].iov_base = shard.recvBuffers[i];
+        iovs[i].iov_len = A2S_MAX_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_name = &shard.recvBatch[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = shard.recvControl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(shard.recvControl[i]);
+    }
 
-    for (int n = 0; n < numPlayers; n++) {
-        uint8_t index = data[i++];
+    int ret = recvmmsg(shard.socket, msgs, A2S_BATCH_SIZE, 0, NULL);
+    shard.stats.recvCalls++;
+    if (ret <= 0) {
+        return 0;
+    }
 
-        // read name (null-terminated)
-        size_t start = i;
-        while (i < data.size() && data[i] != 0)
-            i++;
-        std::string name((char*)&data[start], i - start);
-        i++; // skip null
+    uint64_t recvTime = getEpochMicros();
+
+    for (int i = 0; i < ret; i++) {
+        shard.recvBatch[i].data = shard.recvBuffers[i];
+        shard.recvBatch[i].len = msgs[i].msg_len;
+        shard.recvBatch[i].recvTime = recvTime;
+
+        // the kernel reports how many packets it dropped so far with each packet (SO_RXQ_OVFL),
+        // and when the packet arrived (SO_TIMESTAMPNS), which isn't delayed by the query loop
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+                if (drops > shard.kernelDrops) {
+                    shard.stats.kernelDrops += drops - shard.kernelDrops;
+                    shard.kernelDrops = drops;
+                }
+            }
+            else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(timespec));
+                shard.recvBatch[i].recvTime = (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+            }
+        }
+    }
+#else
+    int ret = 0;
+    for (; ret < A2S_BATCH_SIZE; ret++) {
+        socklen_t len = sizeof(sockaddr_in);
+        A2SPacket& packet = shard.recvBatch[ret];
+        packet.data = shard.recvBuffers[ret];
+        packet.len = recvfrom(shard.socket, (char*)packet.data, A2S_MAX_PACKET_SIZE, 0, (sockaddr*)&packet.addr, &len);
+        shard.stats.recvCalls++;
+
+        if (packet.len <= 0) {
+            break; // no more queued packets
+        }
+        packet.recvTime = getEpochMicros();
+    }
+#endif
+
+    shard.stats.packetsRecv += ret;
+    return ret;
+}
+
+// Bounds-checked reader for a received packet. Reads past the end of the packet fail and set ok to false,
+// so a parser can check for truncated packets once instead of after every read.
+struct PacketReader {
+    const uint8_t* data;
+    int len;
+    int pos;
+    bool ok = true;
+
+    PacketReader(const uint8_t* data, int len, int pos) : data(data), len(len), pos(pos) {}
+
+    // returns false and invalidates the reader if fewer than n bytes are left
+    bool has(int n) {
+        ok = ok && len - pos >= n;
+        return ok;
+    }
 
-        int score = *(int*)&data[i];
-        i += 4;
+    void skip(int n) {
+        if (has(n)) {
+            pos += n;
+        }
+    }
 
-        float duration = *(float*)&data[i];
-        i += 4;
+    uint8_t readByte() {
+        return has(1) ? data[pos++] : 0;
+    }
+
+    int32_t readInt() {
+        int32_t val = 0;
+        if (has(4)) {
+            memcpy(&val, data + pos, 4);
+            pos += 4;
+        }
+        return val;
+    }
 
-        players.push_back({ name, score, duration });
+    float readFloat() {
+        float val = 0;
+        if (has(4)) {
+            memcpy(&val, data + pos, 4);
+            pos += 4;
+        }
+        return val;
+    }
+
+    // returns the length of the null-terminated string at the current position, and skips it.
+    // The string starts at str, which is only valid while the packet buffer is.
+    int readString(const char*& str) {
+        const uint8_t* end = ok && pos < len ? (const uint8_t*)memchr(data + pos, 0, len - pos) : NULL;
+        if (!end) {
+            ok = false;
+            str = "";
+            return 0;
+        }
+
+        str = (const char*)data + pos;
+        int strLen = end - (data + pos);
+        pos += strLen + 1;
+        return strLen;
+    }
+
+    std::string readString() {
+        const char* str;
+        int strLen = readString(str);
+        return std::string(str, strLen);
+    }
+};
+
+// parses an A2S_INFO response in either the Source (0x49) or the obsolete GoldSrc (0x6D) format.
+// Returns false if the packet is truncated.
+bool parseInfo(const uint8_t* data, int len, A2SInfo& info) {
+    PacketReader reader(data, len, 5);
+    const char* skip;
+    uint8_t serverType, environment, vac, bots;
+
+    if (data[4] == 0x6D) {
+        reader.readString(skip); // address
+        info.name = reader.readString();
+        info.map = reader.readString();
+        reader.readString(skip); // folder
+        reader.readString(skip); // game
+        info.players = reader.readByte();
+        info.maxPlayers = reader.readByte();
+        reader.skip(1); // protocol
+        serverType = reader.readByte();
+        environment = reader.readByte();
+        reader.skip(1); // visibility
+
+        if (reader.readByte() == 1) {
+            // mod info: link, download link, null byte, version, size, type and dll
+            reader.readString(skip);
+            reader.readString(skip);
+            reader.skip(1 + 4 + 4 + 1 + 1);
+        }
+
+        vac = reader.readByte();
+        bots = reader.readByte();
+    }
+    else {
+        reader.skip(1); // protocol
+        info.name = reader.readString();
+        info.map = reader.readString();
+        reader.readString(skip); // folder
+        reader.readString(skip); // game
+        reader.skip(2); // app id
+        info.players = reader.readByte();
+        info.maxPlayers = reader.readByte();
+        bots = reader.readByte();
+        serverType = reader.readByte();
+        environment = reader.readByte();
+        reader.skip(1); // visibility
+        vac = reader.readByte();
     }
-    return players;
+
+    // GoldSrc servers use upper case letters
+    info.bots = bots;
+    info.serverType = tolower(serverType);
+    info.environment = tolower(environment);
+    info.vac = vac != 0;
+    return reader.ok;
+}
+
+// true if the job sent a request and is waiting for the response
+bool isWaiting(int state) {
+    return state == QJ_WAIT_INFO || state == QJ_WAIT_CHALLENGE || state == QJ_WAIT_PLAYERS;
+}
+
+// Appends the players in an A2S_PLAYER response to a player list, and sets the range of players that
+// were added. Returns false if the packet is truncated, leaving the list as it was.
+bool parsePlayers(const uint8_t* data, int len, PlayerList& list, uint32_t& firstPlayer, uint16_t& numPlayers) {
+    PacketReader reader(data, len, 5);
+    size_t oldPlayers = list.players.size();
+    size_t oldNames = list.names.size();
+    int count = reader.readByte();
+
+    for (int n = 0; n < count && reader.ok; n++) {
+        reader.skip(1); // index
+
+        const char* name;
+        Player plr;
+        plr.nameLen = reader.readString(name);
+        plr.name = list.names.size();
+        plr.score = reader.readInt();
+        plr.duration = reader.readFloat();
+
+        list.names.insert(list.names.end(), name, name + plr.nameLen);
+        list.players.push_back(plr);
+    }
+
+    if (!reader.ok) {
+        list.players.resize(oldPlayers);
+        list.names.resize(oldNames);
+        return false;
+    }
+
+    firstPlayer = oldPlayers;
+    numPlayers = list.players.size() - oldPlayers;
+    return true;
 } 
 
 uint64_t netaddr_to_uint64(sockaddr_in& addr) {
@@ -120,259 +545,1196 @@ std::string netaddr_to_ipstring(const sockaddr_in& addr)
     return std::string(ipstr) + "_" + std::to_string(ntohs(addr.sin_port));
 }
 
-bool a2s_init() {
-#ifdef _WIN32
-    WSADATA wsa;
-    WSAStartup(MAKEWORD(2, 2), &wsa);
-#endif
-
-    g_a2s_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (g_a2s_socket < 0) {
+// creates a non-blocking socket for a shard, bound to its own ephemeral port
+bool openShardSocket(A2SShard& shard) {
+    shard.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (shard.socket < 0) {
         printf("Failed to create A2S socket\n");
         return false;
     }
 
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
+    if (bind(shard.socket, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Failed to bind A2S socket\n");
+        return false;
+    }
+
+    // responses arrive in bursts
+    int recvBufferSize = A2S_RECV_BUFFER_SIZE;
+    setsockopt(shard.socket, SOL_SOCKET, SO_RCVBUF, (const char*)&recvBufferSize, sizeof(recvBufferSize));
+
+#ifdef __linux__
+    // report dropped packets, so that the send rate can be lowered
+    int reportDrops = 1;
+    setsockopt(shard.socket, SOL_SOCKET, SO_RXQ_OVFL, &reportDrops, sizeof(reportDrops));
+
+    // timestamp packets when they arrive, for round trip times
+    int timestamps = 1;
+    setsockopt(shard.socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+#endif
+
 #ifdef _WIN32
     u_long mode = 1; // 1 = non-blocking, 0 = blocking
-    if (ioctlsocket(g_a2s_socket, FIONBIO, &mode) != 0) {
+    if (ioctlsocket(shard.socket, FIONBIO, &mode) != 0) {
         printf("ioctlsocket failed: %d\n", WSAGetLastError());
     }
 #else
-    int flags = fcntl(g_a2s_socket, F_GETFL, 0);
+    int flags = fcntl(shard.socket, F_GETFL, 0);
     if (flags == -1) {
         printf("fcntl F_GETFL");
     }
 
-    if (fcntl(g_a2s_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+    if (fcntl(shard.socket, F_SETFL, flags | O_NONBLOCK) == -1) {
         printf("fcntl F_SETFL");
     }
 #endif
 
+#ifdef __linux__
+    shard.epoll = epoll_create1(0);
+    if (shard.epoll < 0) {
+        printf("Failed to create A2S epoll instance\n");
+        return false;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = shard.socket;
+    if (epoll_ctl(shard.epoll, EPOLL_CTL_ADD, shard.socket, &event) < 0) {
+        printf("Failed to add A2S socket to epoll\n");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool a2s_init() {
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+    int numShards = std::thread::hardware_concurrency();
+    numShards = numShards < 1 ? 1 : (numShards > A2S_MAX_SHARDS ? A2S_MAX_SHARDS : numShards);
+
+    // shards hold their buffers, so they're never copied after this
+    g_shards = std::vector<A2SShard>(numShards);
+
+    for (A2SShard& shard : g_shards) {
+        if (!openShardSocket(shard)) {
+            return false;
+        }
+    }
+
     return true;
 }
 
 void a2s_cleanup() {
+    for (A2SShard& shard : g_shards) {
+#ifdef _WIN32
+        closesocket(shard.socket);
+#else
+        close(shard.socket);
+#endif
+#ifdef __linux__
+        close(shard.epoll);
+#endif
+    }
+    g_shards.clear();
+
 #ifdef _WIN32
-    closesocket(g_a2s_socket);
     WSACleanup();
+#endif
+}
+
+void TimerWheel::clear(uint64_t now) {
+    for (int i = 0; i < A2S_WHEEL_SLOTS; i++) {
+        slots[i].clear();
+    }
+    tick = now / A2S_WHEEL_TICK;
+    count = 0;
+}
+
+void TimerWheel::add(const ReqTimeout& timeout) {
+    uint64_t slotTick = timeout.deadline / A2S_WHEEL_TICK;
+    slotTick = slotTick > tick ? slotTick : tick;
+    slots[slotTick & (A2S_WHEEL_SLOTS - 1)].push_back(timeout);
+    count++;
+}
+
+void TimerWheel::expire(uint64_t now, std::vector<ReqTimeout>& expired) {
+    uint64_t nowTick = now / A2S_WHEEL_TICK;
+
+    // a full turn visits every slot, so clock jumps beyond that don't need more
+    uint64_t firstTick = nowTick - tick >= A2S_WHEEL_SLOTS ? nowTick - A2S_WHEEL_SLOTS + 1 : tick;
+
+    for (uint64_t t = firstTick; t <= nowTick && count; t++) {
+        std::vector<ReqTimeout>& slot = slots[t & (A2S_WHEEL_SLOTS - 1)];
+
+        for (size_t i = 0; i < slot.size(); ) {
+            if (slot[i].deadline <= now) {
+                expired.push_back(slot[i]);
+                slot[i] = slot.back();
+                slot.pop_back();
+                count--;
+            }
+            else {
+                i++; // later in this tick or a later turn of the wheel
+            }
+        }
+    }
+
+    // the current tick isn't over yet, so it's visited again
+    tick = nowTick;
+}
+
+uint64_t TimerWheel::nextDeadline() const {
+    if (!count) {
+        return 0;
+    }
+
+    uint64_t earliest = UINT64_MAX;
+
+    for (uint64_t t = tick; t < tick + A2S_WHEEL_SLOTS; t++) {
+        const std::vector<ReqTimeout>& slot = slots[t & (A2S_WHEEL_SLOTS - 1)];
+
+        for (const ReqTimeout& timeout : slot) {
+            earliest = timeout.deadline < earliest ? timeout.deadline : earliest;
+        }
+
+        // deadlines in later slots can only be earlier if they're a whole turn later in this one
+        if (earliest < (t + 1) * A2S_WHEEL_TICK) {
+            break;
+        }
+    }
+
+    return earliest;
+}
+
+// waits until a packet can be read or the timeout passes
+void waitForPackets(A2SShard& shard, int timeoutMs) {
+#ifdef __linux__
+    epoll_event event;
+    epoll_wait(shard.epoll, &event, 1, timeoutMs);
 #else
-    close(g_a2s_socket);
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(shard.socket, &readSet);
+
+    timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    select(shard.socket + 1, &readSet, NULL, NULL, &timeout);
 #endif
 }
 
-void a2s_query_all() {
-    uint64_t a2sStartTime = getEpochMillis();
+// true if a response arrived or the request was sent again since the timeout was added
+bool isStaleTimeout(const QueryJob& job, const ReqTimeout& timeout) {
+    return job.reqId != timeout.reqId || !isWaiting(job.state);
+}
 
-    std::unordered_map<uint64_t, QueryJob> jobs;
+// puts a job back into a state that resends its last request, unless it ran out of attempts.
+// Returns false if the job failed.
+bool retryJob(A2SShard& shard, QueryJob& job, int retryState) {
+    job.state = retryState;
+    job.reqAttempts++;
 
-    for (auto& item : g_servers) {
-        if (item.second.unreachable) {
-            item.second.a2s_success = false;
-            item.second.a2s_players.clear();
-            continue;
+    if (job.reqAttempts >= MAX_REQ_ATTEMPTS) {
+        job.state = QJ_DONE;
+        //printf("A2S_PLAYER failed after %d attempts: %s\n", MAX_REQ_ATTEMPTS, netaddr_to_ipstring(job.addr).c_str());
+        return false;
+    }
+
+    shard.stats.retries++;
+    return true;
+}
+
+// returns the parts of a split response to the pool and forgets it
+void freeSplit(A2SShard& shard, int idx) {
+    SplitResponse& split = shard.splits[idx];
+    for (int i = 0; i < split.total; i++) {
+        if (split.parts[i] >= 0) {
+            shard.freeFragments.push_back(split.parts[i]);
         }
+    }
+    shard.splits[idx] = shard.splits[--shard.numSplits];
+}
 
-        uint64_t ip = ipstring_to_uint64(item.first);
+// Adds a part of a split response (GoldSrc format). Returns true once all parts arrived, after pointing
+// the packet at the joined response.
+bool addFragment(A2SShard& shard, uint32_t jobId, A2SPacket& packet, uint64_t now) {
+    const int headerSize = 9; // split marker, response id, part number and count
+    if (packet.len <= headerSize) {
+        shard.stats.fragmentsDropped++;
+        return false;
+    }
 
-        QueryJob job = QueryJob();
-        job.addr = uint64_to_netaddr(ip);
-        jobs[ip] = job;
+    int32_t id;
+    memcpy(&id, packet.data + 4, 4);
+    int number = packet.data[8] >> 4;
+    int total = packet.data[8] & 0xF;
+
+    if (total == 0 || number >= total) {
+        shard.stats.fragmentsDropped++;
+        return false;
     }
 
-    printf("A2S querying %d servers... ", (int)jobs.size());
+    // forget responses that lost parts, so they don't hold buffers until the end of the pass
+    for (int i = 0; i < shard.numSplits; ) {
+        if (now >= shard.splits[i].expireTime) {
+            shard.stats.fragmentsDropped += shard.splits[i].received;
+            freeSplit(shard, i);
+        }
+        else {
+            i++;
+        }
+    }
+
+    int idx = -1;
+    for (int i = 0; i < shard.numSplits; i++) {
+        if (shard.splits[i].job == jobId && shard.splits[i].id == id) {
+            idx = i;
+            break;
+        }
+    }
+
+    if (idx == -1) {
+        if (shard.numSplits == A2S_MAX_SPLITS) {
+            shard.stats.fragmentsDropped++;
+            return false;
+        }
+
+        idx = shard.numSplits++;
+        SplitResponse& split = shard.splits[idx];
+        split.job = jobId;
+        split.id = id;
+        split.total = total;
+        split.received = 0;
+        split.expireTime = now + A2S_SPLIT_LIFETIME;
+        memset(split.parts, -1, sizeof(split.parts));
+    }
+
+    SplitResponse& split = shard.splits[idx];
+
+    if (split.total != total || split.parts[number] >= 0) {
+        return false; // duplicate part
+    }
 
-    std::vector<uint8_t> get_challenge_packet = { 0xFF,0xFF,0xFF,0xFF,0x55,0xFF,0xFF,0xFF,0xFF };
-    std::vector<uint8_t> get_players_packet = { 0xFF,0xFF,0xFF,0xFF, 0x55 };
+    if (shard.freeFragments.empty()) {
+        shard.stats.fragmentsDropped++;
+        return false;
+    }
 
-    while (1) {
-        int runningJobs = 0;
-        int challengeReqs = 0;
-        int playerReqs = 0;
-        int challengeResp = 0;
-        int playerResp = 0;
+    int16_t fragIdx = shard.freeFragments.back();
+    shard.freeFragments.pop_back();
 
+    A2SFragment& frag = shard.fragments[fragIdx];
+    frag.len = packet.len - headerSize;
+    memcpy(frag.data, packet.data + headerSize, frag.len);
+    split.parts[number] = fragIdx;
+    split.received++;
+
+    if (split.received < split.total) {
+        return false;
+    }
+
+    int len = 0;
+    for (int i = 0; i < split.total; i++) {
+        A2SFragment& part = shard.fragments[split.parts[i]];
+        memcpy(shard.joinBuffer + len, part.data, part.len);
+        len += part.len;
+    }
+    freeSplit(shard, idx);
+
+    packet.data = shard.joinBuffer;
+    packet.len = len;
+    shard.stats.splitResponses++;
+    return true;
+}
+
+// adds tokens for the time since the last refill
+void refillTokens(A2SShard& shard) {
+    uint64_t now = getEpochMicros();
+    if (shard.lastRefill) {
+        shard.sendTokens += shard.sendRate * (now - shard.lastRefill) / 1000000.0f;
+        if (shard.sendTokens > A2S_BATCH_SIZE) {
+            shard.sendTokens = A2S_BATCH_SIZE;
+        }
+    }
+    shard.lastRefill = now;
+}
+
+// counts a response to a request sent at sendTime
+void addResponse(A2SShard& shard, uint64_t sendTime, uint64_t now) {
+    shard.intervalRtt += now - sendTime;
+    shard.intervalResponses++;
+    shard.stats.responses++;
+}
+
+// raises or lowers the send rate based on what happened since the last adjustment
+void adaptSendRate(A2SShard& shard, uint64_t now) {
+    if (now - shard.lastAdapt < A2S_PACE_INTERVAL) {
+        return;
+    }
+
+    int requests = shard.intervalResponses + shard.intervalLosses;
+    bool dropped = shard.stats.kernelDrops > shard.intervalDrops;
+    bool lossy = false;
+    bool queued = false;
+
+    // losses are only noticed when requests time out, long after they were sent
+    if (requests >= A2S_MIN_SAMPLES && now - shard.lastDecrease > REQ_TIMEOUT) {
+        float loss = shard.intervalLosses / (float)requests;
+        lossy = shard.avgLoss >= 0 && loss > shard.avgLoss + A2S_MAX_LOSS;
+        shard.avgLoss = shard.avgLoss >= 0 ? shard.avgLoss * 0.75f + loss * 0.25f : loss;
+    }
+
+    if (shard.intervalResponses >= A2S_MIN_SAMPLES) {
+        float rtt = shard.intervalRtt / (float)shard.intervalResponses;
+        queued = shard.baseRtt && rtt > shard.baseRtt * 1.5f + A2S_MAX_DELAY;
+        shard.baseRtt = shard.baseRtt && shard.baseRtt < rtt ? shard.baseRtt : rtt;
+        shard.lastRtt = rtt;
+    }
+
+    // responses that arrive soon after a decrease are to requests sent before it
+    bool settled = now - shard.lastDecrease > shard.lastRtt + A2S_PACE_INTERVAL;
+
+    if ((dropped || lossy || queued) && settled) {
+        shard.sendRate *= 0.7f;
+        shard.lastDecrease = now;
+    }
+    else if (shard.rateLimited && settled) {
+        shard.sendRate *= 1.25f;
+    }
+    shard.sendRate = shard.sendRate < A2S_MIN_RATE ? A2S_MIN_RATE : shard.sendRate;
+    shard.sendRate = shard.sendRate > A2S_MAX_RATE ? A2S_MAX_RATE : shard.sendRate;
+
+    shard.lastAdapt = now;
+    shard.rateLimited = false;
+    shard.intervalRtt = 0;
+    shard.intervalResponses = 0;
+    shard.intervalLosses = 0;
+    shard.intervalDrops = shard.stats.kernelDrops;
+}
+
+// Jobs are only visited when they have a request to send, a response arrived for them, or their
+// request timed out. Between those, the loop sleeps until a packet arrives or the next timeout.
+void queryShard(A2SShard& shard) {
+    uint64_t cpuStartTime = getThreadCpuMicros();
+
+    std::vector<QueryJob>& jobs = shard.jobs;
+    std::unordered_map<uint64_t, uint32_t>& jobIds = shard.jobIds;
+    std::deque<uint32_t>& sendQueue = shard.sendQueue;
+    TimerWheel& timeouts = shard.timeouts;
+
+    uint8_t get_challenge_packet[] = { 0xFF,0xFF,0xFF,0xFF,0x55,0xFF,0xFF,0xFF,0xFF };
+    uint8_t get_players_packet[] = { 0xFF,0xFF,0xFF,0xFF,0x55,0,0,0,0 };
+    uint8_t get_info_packet[] = { 0xFF,0xFF,0xFF,0xFF,0x54,'S','o','u','r','c','e',' ','E','n','g','i','n','e',' ',
+        'Q','u','e','r','y',0, 0,0,0,0 };
+    const int infoPacketSize = sizeof(get_info_packet) - 4; // without a challenge
+
+    int runningJobs = jobs.size();
+
+    while (runningJobs > 0) {
         uint64_t now = getEpochMillis();
 
-        int sentPackets = 0;
+        // retry requests that timed out
+        shard.expired.clear();
+        timeouts.expire(now, shard.expired);
 
-        // send queries
-        for (auto& item : jobs) {
-            QueryJob& job = item.second;
+        for (const ReqTimeout& timeout : shard.expired) {
+            QueryJob& job = jobs[timeout.job];
+            if (isStaleTimeout(job, timeout)) {
+                continue;
+            }
 
-            if (job.state != QJ_DONE)
-                runningJobs++;
+            int retryState = QJ_GOT_CHALLENGE;
+            if (job.state == QJ_WAIT_INFO) {
+                retryState = QJ_GET_INFO;
+            }
+            else if (job.state == QJ_WAIT_CHALLENGE) {
+                retryState = QJ_NOT_STARTED;
+            }
+            shard.stats.timeouts++;
+            job.timedOut = true;
+
+            // servers may ignore requests with an old challenge, so get a new one
+            if (job.state == QJ_WAIT_PLAYERS && job.cachedChallenge) {
+                job.cachedChallenge = false;
+                retryState = QJ_NOT_STARTED;
+                shard.stats.staleChallenges++;
+            }
 
-            bool sentPacket = false;
+            // servers that never respond are likely offline, so only count losses from the others
+            if (job.responded) {
+                shard.intervalLosses++;
+            }
+
+            if (retryJob(shard, job, retryState)) {
+                sendQueue.push_back(timeout.job);
+            }
+            else {
+                runningJobs--;
+            }
+        }
+
+        adaptSendRate(shard, now);
+        refillTokens(shard);
+        uint64_t sendMicros = getEpochMicros();
+
+        // send queries
+        while (!sendQueue.empty() && shard.sendTokens >= 1) {
+            uint32_t jobId = sendQueue.front();
+            sendQueue.pop_front();
+            QueryJob& job = jobs[jobId];
 
             switch (job.state) {
+            case QJ_GET_INFO:
+                // the challenge is only appended after the server asks for it
+                if (job.infoChallenge) {
+                    memcpy(get_info_packet + infoPacketSize, &job.infoChallenge, 4);
+                    sendPacket(shard, job.addr, get_info_packet, infoPacketSize + 4);
+                }
+                else {
+                    sendPacket(shard, job.addr, get_info_packet, infoPacketSize);
+                }
+                job.state = QJ_WAIT_INFO;
+                break;
             case QJ_NOT_STARTED:
                 //printf("Get challenge: %s\n", netaddr_to_ipstring(job.addr).c_str());
-                sendPacket(job.addr, get_challenge_packet);
+                sendPacket(shard, job.addr, get_challenge_packet, sizeof(get_challenge_packet));
                 job.state = QJ_WAIT_CHALLENGE;
-                job.lastReq = now;
-                challengeReqs++;
-                sentPackets++;
+                shard.stats.challengeReqs++;
                 break;
             case QJ_GOT_CHALLENGE: {
-                std::vector<uint8_t> p = get_players_packet;
-                p.insert(p.end(), (uint8_t*)&job.challenge, (uint8_t*)&job.challenge + 4);
-                sendPacket(job.addr, p);
+                memcpy(get_players_packet + 5, &job.challenge, 4);
+                sendPacket(shard, job.addr, get_players_packet, sizeof(get_players_packet));
                 //printf("Get players: %s\n", netaddr_to_ipstring(job.addr).c_str());
                 job.state = QJ_WAIT_PLAYERS;
-                job.lastReq = now;
-                playerReqs++;
-                sentPackets++;
-                break;
-            }
-            case QJ_WAIT_CHALLENGE:
-                if (now - job.lastReq > REQ_TIMEOUT) {
-                    job.state = QJ_NOT_STARTED; // retry the request
-                    job.reqAttempts++;
-
-                    if (job.reqAttempts >= MAX_REQ_ATTEMPTS) {
-                        job.state = QJ_DONE;
-                        //printf("A2S_PLAYER failed after %d attempts: %s\n", MAX_REQ_ATTEMPTS, netaddr_to_ipstring(job.addr).c_str());
-                    }
+                if (job.cachedChallenge) {
+                    shard.stats.cachedChallenges++;
                 }
                 break;
-            case QJ_WAIT_PLAYERS:
-                if (now - job.lastReq > REQ_TIMEOUT) {
-                    job.state = QJ_GOT_CHALLENGE; // retry the request
-                    job.reqAttempts++;
-
-                    if (job.reqAttempts >= MAX_REQ_ATTEMPTS) {
-                        job.state = QJ_DONE;
-                        //printf("A2S_PLAYER failed after %d attempts: %s\n", MAX_REQ_ATTEMPTS, netaddr_to_ipstring(job.addr).c_str());
-                    }
-                }
-                break;
-            case QJ_DONE:
-                break;
+            }
             default:
-                printf("Invalid job state %d\n", job.state);
-                break;
+                continue; // job moved on after it was queued
             }
 
-            if (sentPackets >= 100)
-               break; // don't send too many at once
+            job.lastReq = now;
+            job.lastReqMicros = sendMicros;
+            job.reqId++;
+            shard.sendTokens -= 1;
+
+            ReqTimeout timeout;
+            timeout.deadline = now + REQ_TIMEOUT + 1;
+            timeout.job = jobId;
+            timeout.reqId = job.reqId;
+            timeouts.add(timeout);
         }
 
+        flushPackets(shard);
+
+        // wait for responses, or until the next request can be sent or times out
+        int waitTime = 1;
+        if (!sendQueue.empty()) {
+            shard.rateLimited = true;
+            waitTime = ceilf((1 - shard.sendTokens) * 1000 / shard.sendRate);
+        }
+        else if (!timeouts.empty()) {
+            uint64_t deadline = timeouts.nextDeadline();
+            now = getEpochMillis();
+            waitTime = deadline > now ? deadline - now : 0;
+        }
+        waitForPackets(shard, waitTime);
+        shard.wakeups++;
+
         // receive responses
-        while (1) {
-            static uint8_t buf[4096];
-            socklen_t len = sizeof(sockaddr_in);
-            sockaddr_in from;
+        int received;
+        do {
+            received = receivePackets(shard);
+            uint64_t recvTime = getEpochMillis();
 
-            int ret = recvfrom(g_a2s_socket, (char*)buf, sizeof(buf), 0, (sockaddr*)&from, &len);
-            if (ret <= 0)
-                break; // no more queued packets
+            for (int i = 0; i < received; i++) {
+                A2SPacket& packet = shard.recvBatch[i];
 
-            uint64_t ipint = netaddr_to_uint64(from);
-            auto item = jobs.find(ipint);
+                uint64_t ipint = netaddr_to_uint64(packet.addr);
+                auto item = jobIds.find(ipint);
 
-            if (item == jobs.end()) {
-                //printf("Ignored %d byte packet from unknown ip: %s\n", ret, netaddr_to_ipstring(from).c_str());
-                continue;
-            }
+                if (item == jobIds.end()) {
+                    //printf("Ignored %d byte packet from unknown ip: %s\n", packet.len, netaddr_to_ipstring(packet.addr).c_str());
+                    continue;
+                }
 
-            QueryJob& job = item->second;
+                uint32_t jobId = item->second;
+                QueryJob& job = jobs[jobId];
 
-            std::vector<uint8_t> data(buf, buf + ret);
+                // large responses are split into multiple packets, which are handled once they all arrived
+                if (packet.len >= 4 && PacketReader(packet.data, packet.len, 0).readInt() == -2
+                    && !addFragment(shard, jobId, packet, recvTime)) {
+                    continue;
+                }
 
-            switch (job.state) {
-            case QJ_WAIT_CHALLENGE: {
-                if (data.size() < 9 || data[4] != 0x41) {
-                    if (data.size() > 4 && data[4] == 0x44) {
-                        // some servers return the player list without a challenge
-                        job.players = parsePlayers(data);
-                        job.state = QJ_DONE;
-                        job.success = true;
-                        //printf("Recv %d players from %s\n", (int)job.players.size(), netaddr_to_ipstring(from).c_str());
-                        playerResp++;
-                        break;
+                // responses are parsed in place, in the receive buffer
+                const uint8_t* data = packet.data;
+                int len = packet.len;
+                uint8_t type = len > 4 ? data[4] : 0; // follows the 0xFFFFFFFF header
+
+                // some servers send info in both formats, and the second one arrives after the job moved on
+                bool isInfo = type == 0x49 || type == 0x6D;
+                if (isInfo && job.state != QJ_WAIT_INFO) {
+                    continue;
+                }
+
+                if (isWaiting(job.state)) {
+                    job.responded = true;
+                    addResponse(shard, job.lastReq, recvTime);
+
+                    // a late reply to a request that timed out would be timed from the newer request
+                    if (!job.timedOut && job.numRtts < A2S_MAX_RTT_SAMPLES && packet.recvTime > job.lastReqMicros) {
+                        job.rtts[job.numRtts++] = packet.recvTime - job.lastReqMicros;
                     }
+                }
 
-                    //printf("unexpected challenge response from %s\n", netaddr_to_ipstring(from).c_str());
-                    job.state = QJ_NOT_STARTED;
-                    job.reqAttempts++;
+                switch (job.state) {
+                case QJ_WAIT_INFO:
+                    if (len >= 9 && type == 0x41) {
+                        // the info request has to be sent again with the challenge
+                        job.infoChallenge = PacketReader(data, len, 5).readInt();
+                        if (retryJob(shard, job, QJ_GET_INFO)) {
+                            sendQueue.push_back(jobId);
+                        }
+                        else {
+                            runningJobs--;
+                        }
+                        break;
+                    }
 
-                    if (job.reqAttempts >= MAX_REQ_ATTEMPTS) {
-                        job.state = QJ_DONE;
-                        //printf("A2S_PLAYER failed after %d attempts: %s\n", MAX_REQ_ATTEMPTS, netaddr_to_ipstring(job.addr).c_str());
+                    if (!isInfo || !parseInfo(data, len, job.info)) {
+                        //printf("unexpected info response from %s\n", netaddr_to_ipstring(packet.addr).c_str());
+                        if (retryJob(shard, job, QJ_GET_INFO)) {
+                            sendQueue.push_back(jobId);
+                        }
+                        else {
+                            runningJobs--;
+                        }
+                        break;
                     }
+
+                    // now get the player list, skipping the challenge if it's cached
+                    job.gotInfo = true;
+                    job.state = job.cachedChallenge ? QJ_GOT_CHALLENGE : QJ_NOT_STARTED;
+                    job.reqAttempts = 0;
+                    sendQueue.push_back(jobId);
+                    shard.stats.infoResponses++;
                     break;
-                }
+                case QJ_WAIT_CHALLENGE: {
+                    if (len < 9 || type != 0x41) {
+                        if (type == 0x44 && parsePlayers(data, len, shard.players, job.firstPlayer, job.numPlayers)) {
+                            // some servers return the player list without a challenge. The challenge
+                            // request is then reused as the player request in the next pass.
+                            job.challenge = -1;
+                            job.state = QJ_DONE;
+                            job.success = true;
+                            runningJobs--;
+                            //printf("Recv %d players from %s\n", (int)job.numPlayers, netaddr_to_ipstring(packet.addr).c_str());
+                            break;
+                        }
+
+                        //printf("unexpected challenge response from %s\n", netaddr_to_ipstring(packet.addr).c_str());
+                        if (retryJob(shard, job, QJ_NOT_STARTED)) {
+                            sendQueue.push_back(jobId);
+                        }
+                        else {
+                            runningJobs--;
+                        }
+                        break;
+                    }
 
-                job.challenge = *(int*)&data[5];
-                job.state = QJ_GOT_CHALLENGE;
-                job.reqAttempts = 0;
-                //printf("Recv challenge %X from %s\n", job.challenge, netaddr_to_ipstring(from).c_str());
-                challengeResp++;
-                break;
-            }
-            case QJ_WAIT_PLAYERS:
-                if (data.size() < 6 || data[4] != 0x44) {
-                    //printf("unexpected players response from %s\n", netaddr_to_ipstring(from).c_str());
+                    job.challenge = PacketReader(data, len, 5).readInt();
                     job.state = QJ_GOT_CHALLENGE;
-                    job.reqAttempts++;
+                    job.reqAttempts = 0;
+                    sendQueue.push_back(jobId);
+                    //printf("Recv challenge %X from %s\n", job.challenge, netaddr_to_ipstring(packet.addr).c_str());
+                    break;
+                }
+                case QJ_WAIT_PLAYERS:
+                    if (len >= 9 && type == 0x41) {
+                        // the server wants a new challenge, likely because the cached one expired
+                        if (job.cachedChallenge) {
+                            job.cachedChallenge = false;
+                            shard.stats.staleChallenges++;
+                        }
+
+                        job.challenge = PacketReader(data, len, 5).readInt();
+                        if (retryJob(shard, job, QJ_GOT_CHALLENGE)) {
+                            sendQueue.push_back(jobId);
+                        }
+                        else {
+                            runningJobs--;
+                        }
+                        break;
+                    }
 
-                    if (job.reqAttempts >= MAX_REQ_ATTEMPTS) {
-                        job.state = QJ_DONE;
-                        //printf("A2S_PLAYER failed after %d attempts: %s\n", MAX_REQ_ATTEMPTS, netaddr_to_ipstring(job.addr).c_str());
+                    if (len < 6 || type != 0x44 || !parsePlayers(data, len, shard.players, job.firstPlayer, job.numPlayers)) {
+                        //printf("unexpected players response from %s\n", netaddr_to_ipstring(packet.addr).c_str());
+                        if (retryJob(shard, job, QJ_GOT_CHALLENGE)) {
+                            sendQueue.push_back(jobId);
+                        }
+                        else {
+                            runningJobs--;
+                        }
+                        break;
                     }
+
+                    job.state = QJ_DONE;
+                    job.success = true;
+                    job.cachedChallenge = false;
+                    runningJobs--;
+                    //printf("Recv %d players from %s\n", (int)job.numPlayers, netaddr_to_ipstring(packet.addr).c_str());
+                    break;
+                case QJ_NOT_STARTED:
+                case QJ_GOT_CHALLENGE:
+                case QJ_GET_INFO:
+                case QJ_DONE:
+                    //printf("Received packet while in state %d: %s\n", job.state, netaddr_to_ipstring(packet.addr).c_str());
+                    break;
+                default:
+                    printf("Invalid job state %d\n", job.state);
                     break;
                 }
-
-                job.players = parsePlayers(data);
-                job.state = QJ_DONE;
-                job.success = true;
-                //printf("Recv %d players from %s\n", (int)job.players.size(), netaddr_to_ipstring(from).c_str());
-                playerResp++;
-                break;
-            case QJ_NOT_STARTED:
-            case QJ_GOT_CHALLENGE:
-            case QJ_DONE:
-                //printf("Received packet while in state %d: %s\n", job.state, netaddr_to_ipstring(from).c_str());
-                break;
-            default:
-                printf("Invalid job state %d\n", job.state);
-                break;
             }
+        } while (received == A2S_BATCH_SIZE);
+    }
+
+    shard.cpuMicros = getThreadCpuMicros() - cpuStartTime;
+}
+
+void a2s_query_all(bool queryInfo) {
+    uint64_t a2sStartTime = getEpochMillis();
+
+    for (A2SShard& shard : g_shards) {
+        shard.jobs.clear();
+        shard.players.clear();
+        shard.jobIds.clear();
+        shard.sendQueue.clear();
+        shard.timeouts.clear(a2sStartTime);
+        shard.sendBatchSize = 0;
+        shard.numSplits = 0;
+        shard.freeFragments.clear();
+        for (int i = 0; i < A2S_FRAGMENT_POOL_SIZE; i++) {
+            shard.freeFragments.push_back(i);
         }
+        memset(&shard.stats, 0, sizeof(A2SPassStats));
+        shard.lastRefill = 0;
+        shard.lastAdapt = getEpochMillis();
+        shard.lastDecrease = shard.lastAdapt;
+        shard.baseRtt = 0;
+        shard.lastRtt = 0;
+        shard.avgLoss = -1;
+        shard.intervalRtt = 0;
+        shard.intervalResponses = 0;
+        shard.intervalLosses = 0;
+        shard.intervalDrops = 0;
+        shard.wakeups = 0;
+        shard.cpuMicros = 0;
+    }
 
-        //printf("SENT: %d chg, %d plr | RECV: %d chg, %d plr | JOBS: %d / %d\n",
-        //    challengeReqs, playerReqs, challengeResp, playerResp, runningJobs, (int)jobs.size());
+    int numJobs = 0;
 
-        if (runningJobs == 0)
-            break;
+    for (auto& item : g_servers) {
+        // unreachable servers are only queried when their info is needed to tell when they're back
+        if (item.second.unreachable && !queryInfo) {
+            item.second.a2s_success = false;
+            item.second.a2s_info_success = false;
+            item.second.a2s_numPlayers = 0;
+            item.second.a2s_rttMin = 0;
+            item.second.a2s_rttMedian = 0;
+            continue;
+        }
 
-        std::this_thread::sleep_for(milliseconds(1));
+        uint64_t ip = ipstring_to_uint64(item.first);
+        A2SShard& shard = g_shards[((ip * 0x9E3779B97F4A7C15ULL) >> 32) % g_shards.size()];
+
+        if (shard.jobIds.count(ip)) {
+            continue;
+        }
+
+        QueryJob job = QueryJob();
+        job.addr = uint64_to_netaddr(ip);
+
+        // skip the challenge request if the server accepted a challenge before
+        if (item.second.a2s_challenge) {
+            job.challenge = item.second.a2s_challenge;
+            job.cachedChallenge = true;
+            job.state = QJ_GOT_CHALLENGE;
+        }
+        if (queryInfo) {
+            job.state = QJ_GET_INFO;
+        }
+        shard.jobIds[ip] = shard.jobs.size();
+        shard.sendQueue.push_back(shard.jobs.size());
+        shard.jobs.push_back(job);
+        numJobs++;
     }
 
+    printf("A2S querying %d servers... ", numJobs);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < g_shards.size(); i++) {
+        threads.push_back(std::thread(queryShard, std::ref(g_shards[i])));
+    }
+    queryShard(g_shards[0]);
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 
     // update server info player lists
     int numFail = 0;
+    int wakeups = 0;
+    uint64_t cpuMicros = 0;
+    float sendRate = 0;
+    A2SPassStats calls;
+    memset(&calls, 0, sizeof(A2SPassStats));
+
+    g_a2sPlayers.resize(g_shards.size());
+
+    for (size_t s = 0; s < g_shards.size(); s++) {
+        A2SShard& shard = g_shards[s];
+        wakeups += shard.wakeups;
+        cpuMicros += shard.cpuMicros;
+        sendRate += shard.sendRate;
+        calls.sendCalls += shard.stats.sendCalls;
+        calls.packetsSent += shard.stats.packetsSent;
+        calls.recvCalls += shard.stats.recvCalls;
+        calls.packetsRecv += shard.stats.packetsRecv;
+        calls.responses += shard.stats.responses;
+        calls.timeouts += shard.stats.timeouts;
+        calls.retries += shard.stats.retries;
+        calls.kernelDrops += shard.stats.kernelDrops;
+        calls.challengeReqs += shard.stats.challengeReqs;
+        calls.cachedChallenges += shard.stats.cachedChallenges;
+        calls.staleChallenges += shard.stats.staleChallenges;
+        calls.infoResponses += shard.stats.infoResponses;
+        calls.splitResponses += shard.stats.splitResponses;
+        calls.fragmentsDropped += shard.stats.fragmentsDropped;
+
+        for (QueryJob& job : shard.jobs) {
+            std::string ipstr = netaddr_to_ipstring(job.addr);
+
+            auto serv = g_servers.find(ipstr);
+
+            if (serv == g_servers.end()) {
+                printf("A2S finished for unknown server: %s\n", ipstr.c_str());
+                continue;
+            }
 
-    for (auto& item : jobs) {
-        QueryJob& job = item.second;
+            ServerState& state = serv->second;
 
-        std::string ipstr = netaddr_to_ipstring(job.addr);
+            state.a2s_playerList = s;
+            state.a2s_firstPlayer = job.firstPlayer;
+            state.a2s_numPlayers = job.numPlayers;
 
-        auto serv = g_servers.find(ipstr);
-        
-        if (serv == g_servers.end()) {
-            printf("A2S finished for unknown server: %s\n", ipstr.c_str());
-            continue;
+            std::sort(job.rtts, job.rtts + job.numRtts);
+            state.a2s_rttMin = job.numRtts ? job.rtts[0] : 0;
+            state.a2s_rttMedian = job.numRtts ? job.rtts[job.numRtts / 2] : 0;
+            state.a2s_success = job.success;
+            state.a2s_challenge = job.success ? job.challenge : 0;
+            state.a2s_info = job.info;
+            state.a2s_info_success = job.gotInfo;
+
+            if (!job.success && !state.unreachable)
+                numFail++;
         }
 
-        ServerState& state = serv->second;
+        // the last pass's list is cleared and reused by the next pass
+        std::swap(g_a2sPlayers[s], shard.players);
+    }
+
+    float passTime = (getEpochMillis() - a2sStartTime) / 1000.0f;
+    int requests = calls.responses + calls.timeouts;
+
+    printf("%.2fs (%d failed, %d shards, %d wakeups, %.1fms CPU)\n", passTime, numFail,
+        (int)g_shards.size(), wakeups, cpuMicros / 1000.0f);
+    printf("A2S pacing: %.0f packets/s sent (limit now %.0f/s), %.1f%% lost, %d retries, %u dropped by the kernel\n",
+        calls.packetsSent / (passTime > 0 ? passTime : 1), sendRate, requests ? calls.timeouts * 100.0f / requests : 0.0f,
+        calls.retries, calls.kernelDrops);
+    printf("A2S challenges: %d requested, %d reused from the last pass (%d stale)\n",
+        calls.challengeReqs, calls.cachedChallenges, calls.staleChallenges);
+    if (queryInfo) {
+        printf("A2S info: %d/%d servers responded\n", calls.infoResponses, numJobs);
+    }
+    if (calls.splitResponses || calls.fragmentsDropped) {
+        printf("A2S split responses: %d joined, %d parts dropped\n", calls.splitResponses, calls.fragmentsDropped);
+    }
+    printf("A2S syscalls: %d sent in %d (%.1f per call), %d received in %d (%.1f per call)\n",
+        calls.packetsSent, calls.sendCalls, calls.packetsSent / (float)(calls.sendCalls ? calls.sendCalls : 1),
+        calls.packetsRecv, calls.recvCalls, calls.packetsRecv / (float)(calls.recvCalls ? calls.recvCalls : 1));
+}
 
-        state.a2s_players = job.players;
-        state.a2s_success = job.success;
 
-        if (!job.success && !state.unreachable)
-            numFail++;
+// builds a part of a split response in the GoldSrc format
+std::vector<uint8_t> makeTestFragment(int32_t id, int number, int total, const std::vector<uint8_t>& response, int partSize) {
+    std::vector<uint8_t> packet = { 0xFE, 0xFF, 0xFF, 0xFF };
+    packet.insert(packet.end(), (uint8_t*)&id, (uint8_t*)&id + 4);
+    packet.push_back((number << 4) | total);
+
+    int start = number * partSize;
+    int end = std::min((int)response.size(), start + partSize);
+    packet.insert(packet.end(), response.begin() + start, response.begin() + end);
+    return packet;
+}
+
+// a player list response that's split into parts
+std::vector<uint8_t> makeTestResponse(int numPlayers, uint8_t seed) {
+    std::vector<uint8_t> response = { 0xFF, 0xFF, 0xFF, 0xFF, 0x44, (uint8_t)numPlayers };
+    for (int i = 0; i < numPlayers; i++) {
+        response.push_back(i);
+        std::string name = "player" + std::to_string(seed) + "_" + std::to_string(i);
+        response.insert(response.end(), name.c_str(), name.c_str() + name.size() + 1);
+        int32_t score = i * seed;
+        float duration = i * 60.0f;
+        response.insert(response.end(), (uint8_t*)&score, (uint8_t*)&score + 4);
+        response.insert(response.end(), (uint8_t*)&duration, (uint8_t*)&duration + 4);
+    }
+    return response;
+}
+
+void resetTestShard(A2SShard& shard) {
+    shard.numSplits = 0;
+    shard.freeFragments.clear();
+    for (int i = 0; i < A2S_FRAGMENT_POOL_SIZE; i++) {
+        shard.freeFragments.push_back(i);
+    }
+    memset(&shard.stats, 0, sizeof(A2SPassStats));
+}
+
+// Adds the parts in the order given, copying a joined response out as soon as it's complete, like the
+// query loop handles the packets of a receive batch. Returns the joined responses.
+std::vector<std::vector<uint8_t>> addTestFragments(A2SShard& shard, const std::vector<uint32_t>& jobs,
+    const std::vector<std::vector<uint8_t>>& parts, uint64_t now)
+{
+    std::vector<std::vector<uint8_t>> joined;
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        A2SPacket& packet = shard.recvBatch[i % A2S_BATCH_SIZE];
+        packet.data = shard.recvBuffers[i % A2S_BATCH_SIZE];
+        packet.len = parts[i].size();
+        memcpy(packet.data, parts[i].data(), parts[i].size());
+
+        if (addFragment(shard, jobs[i], packet, now)) {
+            joined.push_back(std::vector<uint8_t>(packet.data, packet.data + packet.len));
+        }
     }
 
-    printf("%.2fs (%d failed)\n", (getEpochMillis() - a2sStartTime) / 1000.0f, numFail);
-}
\ No newline at end of file
+    return joined;
+}
+
+// parses a player list response into a list that already has players of another server.
+// Returns false if parsing failed or didn't leave the list as expected.
+bool parseTestPlayers(const std::vector<uint8_t>& response, PlayerList& list, bool expectValid, int expectedPlayers) {
+    list.clear();
+    uint32_t firstPlayer = 0;
+    uint16_t numPlayers = 0;
+    std::vector<uint8_t> otherServer = makeTestResponse(2, 9);
+    parsePlayers(otherServer.data(), otherServer.size(), list, firstPlayer, numPlayers);
+
+    std::vector<Player> oldPlayers = list.players;
+    std::vector<char> oldNames = list.names;
+
+    bool valid = parsePlayers(response.data(), response.size(), list, firstPlayer, numPlayers);
+    if (valid != expectValid) {
+        return false;
+    }
+
+    if (!valid) {
+        // the players of the other server are left as they were
+        return list.players.size() == oldPlayers.size() && list.names == oldNames
+            && !memcmp(list.players.data(), oldPlayers.data(), oldPlayers.size() * sizeof(Player));
+    }
+
+    if (firstPlayer != oldPlayers.size() || numPlayers != expectedPlayers) {
+        return false;
+    }
+
+    for (int i = 0; i < numPlayers; i++) {
+        const Player& plr = list.players[firstPlayer + i];
+        std::string name = "player1_" + std::to_string(i);
+        if (list.getName(plr) != name || plr.score != i || plr.duration != i * 60.0f) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int a2s_test() {
+    std::vector<A2SShard> shards(1); // too big for the stack
+    A2SShard& shard = shards[0];
+    int failures = 0;
+
+    std::vector<uint8_t> response = makeTestResponse(20, 1);
+    const int partSize = 100;
+    int total = (response.size() + partSize - 1) / partSize;
+
+    // parts arriving out of order are joined in order
+    resetTestShard(shard);
+    std::vector<std::vector<uint8_t>> parts;
+    for (int i = total - 1; i >= 0; i--) {
+        parts.push_back(makeTestFragment(7, i, total, response, partSize));
+    }
+    std::vector<std::vector<uint8_t>> joined = addTestFragments(shard, std::vector<uint32_t>(parts.size(), 0), parts, 1000);
+
+    if (joined.size() != 1 || joined[0] != response || shard.freeFragments.size() != A2S_FRAGMENT_POOL_SIZE) {
+        printf("FAIL: split response with parts in reverse order wasn't joined\n");
+        failures++;
+    }
+    else {
+        printf("PASS: split response with %d parts in reverse order was joined\n", total);
+    }
+
+    // duplicate parts are ignored and don't take buffers from the pool
+    resetTestShard(shard);
+    parts.clear();
+    for (int i = 0; i < total; i++) {
+        parts.push_back(makeTestFragment(8, i, total, response, partSize));
+        parts.push_back(parts.back());
+    }
+    parts.pop_back(); // the last part completes the response
+    joined = addTestFragments(shard, std::vector<uint32_t>(parts.size(), 0), parts, 1000);
+
+    if (joined.size() != 1 || joined[0] != response || shard.freeFragments.size() != A2S_FRAGMENT_POOL_SIZE) {
+        printf("FAIL: split response with duplicate parts wasn't joined once\n");
+        failures++;
+    }
+    else {
+        printf("PASS: duplicate parts of a split response were ignored\n");
+    }
+
+    // Parts that arrive after the response expired aren't joined with the parts from before.
+    // The expired parts go back to the pool.
+    resetTestShard(shard);
+    parts.clear();
+    parts.push_back(makeTestFragment(9, 0, total, response, partSize));
+    joined = addTestFragments(shard, { 0 }, parts, 1000);
+
+    parts.clear();
+    for (int i = 1; i < total; i++) {
+        parts.push_back(makeTestFragment(9, i, total, response, partSize));
+    }
+    std::vector<std::vector<uint8_t>> lateJoined = addTestFragments(shard,
+        std::vector<uint32_t>(parts.size(), 0), parts, 1000 + A2S_SPLIT_LIFETIME);
+    int heldParts = A2S_FRAGMENT_POOL_SIZE - shard.freeFragments.size();
+
+    if (!joined.empty() || !lateJoined.empty() || shard.stats.fragmentsDropped != 1 || heldParts != total - 1) {
+        printf("FAIL: expired split response was joined or kept its parts (%d dropped, %d held)\n",
+            shard.stats.fragmentsDropped, heldParts);
+        failures++;
+    }
+    else {
+        printf("PASS: parts of an expired split response were dropped\n");
+    }
+
+    // Split responses from two servers, and two from the same server, arrive interleaved in one receive batch.
+    // Each joined response is handled before the next packet reuses the join buffer.
+    resetTestShard(shard);
+    std::vector<uint8_t> responses[3] = { makeTestResponse(20, 2), makeTestResponse(25, 3), makeTestResponse(15, 4) };
+    uint32_t responseJobs[3] = { 0, 1, 0 };
+    int32_t responseIds[3] = { 5, 5, 6 };
+    std::vector<uint32_t> jobs;
+    parts.clear();
+
+    for (int i = 0; i < A2S_MAX_FRAGMENTS; i++) {
+        for (int r = 0; r < 3; r++) {
+            int numParts = (responses[r].size() + partSize - 1) / partSize;
+            if (i < numParts) {
+                parts.push_back(makeTestFragment(responseIds[r], i, numParts, responses[r], partSize));
+                jobs.push_back(responseJobs[r]);
+            }
+        }
+    }
+    joined = addTestFragments(shard, jobs, parts, 1000);
+
+    bool allJoined = joined.size() == 3 && parts.size() <= A2S_BATCH_SIZE;
+    for (int r = 0; r < 3 && allJoined; r++) {
+        allJoined = std::find(joined.begin(), joined.end(), responses[r]) != joined.end();
+    }
+
+    if (!allJoined || shard.freeFragments.size() != A2S_FRAGMENT_POOL_SIZE) {
+        printf("FAIL: %d of 3 interleaved split responses were joined\n", (int)joined.size());
+        failures++;
+    }
+    else {
+        printf("PASS: 3 interleaved split responses in one receive batch were joined\n");
+    }
+
+    // The GoldSrc header has the part number and count in one byte. Parts without a payload, or with
+    // a number past the count, are dropped. So is a part whose count differs from the earlier parts.
+    resetTestShard(shard);
+    std::vector<uint8_t> single = makeTestFragment(10, 0, 1, response, partSize);
+    std::vector<uint8_t> headerOnly = makeTestFragment(11, 0, 2, response, partSize);
+    headerOnly.resize(9);
+    std::vector<uint8_t> badNumber = makeTestFragment(12, 3, 3, response, partSize);
+    std::vector<uint8_t> noCount = makeTestFragment(13, 0, 0, response, partSize);
+    std::vector<uint8_t> firstPart = makeTestFragment(14, 0, 2, response, partSize);
+    std::vector<uint8_t> wrongCount = makeTestFragment(14, 1, 3, response, partSize);
+    joined = addTestFragments(shard, { 0, 0, 0, 0, 0, 0 }, { single, headerOnly, badNumber, noCount, firstPart, wrongCount }, 1000);
+
+    std::vector<uint8_t> singlePayload(response.begin(), response.begin() + partSize);
+    bool headerOk = joined.size() == 1 && joined[0] == singlePayload && shard.stats.fragmentsDropped == 3
+        && shard.numSplits == 1 && shard.freeFragments.size() == A2S_FRAGMENT_POOL_SIZE - 1;
+
+    if (!headerOk) {
+        printf("FAIL: GoldSrc split headers weren't checked (%d joined, %d dropped)\n",
+            (int)joined.size(), shard.stats.fragmentsDropped);
+        failures++;
+    }
+    else {
+        printf("PASS: GoldSrc split headers were checked\n");
+    }
+
+    // Player lists cut off inside a name, score or duration, or with fewer players than the count says,
+    // are rejected without changing the list
+    PlayerList list;
+    std::vector<uint8_t> players = makeTestResponse(3, 1);
+    int lastPlayer = players.size() - (1 + 9 + 4 + 4); // index, "player1_2\0", score, duration
+
+    std::vector<uint8_t> cutName(players.begin(), players.begin() + lastPlayer + 1 + 5);
+    std::vector<uint8_t> cutScore(players.begin(), players.begin() + lastPlayer + 1 + 9 + 2);
+    std::vector<uint8_t> cutDuration(players.begin(), players.end() - 2);
+    std::vector<uint8_t> extraCount = players;
+    extraCount[5] = 4;
+
+    struct {
+        const char* desc;
+        std::vector<uint8_t>& response;
+        bool valid;
+    } playerCases[] = {
+        { "a complete player list", players, true },
+        { "a truncated name", cutName, false },
+        { "a short score", cutScore, false },
+        { "a short duration", cutDuration, false },
+        { "a player count larger than the payload", extraCount, false },
+    };
+
+    for (auto& test : playerCases) {
+        if (!parseTestPlayers(test.response, list, test.valid, 3)) {
+            printf("FAIL: player list with %s wasn't %s\n", test.desc, test.valid ? "parsed" : "rejected");
+            failures++;
+        }
+        else {
+            printf("PASS: player list with %s was %s\n", test.desc, test.valid ? "parsed" : "rejected");
+        }
+    }
+
+    // reads past the end fail, and the reader stays invalid even if later reads would fit
+    uint8_t bytes[] = { 1, 2, 3, 'a', 'b' };
+    PacketReader reader(bytes, sizeof(bytes), 0);
+    const char* str;
+    bool readerOk = reader.readByte() == 1 && reader.readByte() == 2 && reader.readInt() == 0 && !reader.ok
+        && reader.readByte() == 0 && !reader.ok;
+
+    PacketReader strReader(bytes, sizeof(bytes), 3);
+    readerOk = readerOk && strReader.readString(str) == 0 && !strReader.ok && !strcmp(str, "");
+
+    PacketReader floatReader(bytes, sizeof(bytes), 2);
+    readerOk = readerOk && floatReader.readFloat() == 0 && !floatReader.ok;
+
+    if (!readerOk) {
+        printf("FAIL: packet reader read past the end of a packet\n");
+        failures++;
+    }
+    else {
+        printf("PASS: packet reader stopped at the end of the packet\n");
+    }
+
+
+    // Timeouts up to 5 turns of the wheel ahead, some in the same slot as others a whole turn apart, and
+    // some already due when they're added. Each fires on the first expire at or after its deadline,
+    // and nextDeadline is always the earliest pending deadline.
+    TimerWheel& wheel = shard.timeouts;
+    const uint64_t turn = A2S_WHEEL_SLOTS * A2S_WHEEL_TICK;
+    uint64_t now = 1000003;
+    wheel.clear(now);
+
+    std::vector<ReqTimeout> pending;
+    std::vector<ReqTimeout> expired;
+    uint32_t seed = 777;
+    int wheelErrors = 0;
+
+    for (uint32_t i = 0; i < 2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+
+        if (i % 3 != 2) {
+            ReqTimeout timeout;
+            timeout.deadline = r % 17 == 0 ? now - r % 50 : r % 5 == 0 ? now + (1 + r % 5) * turn : now + r % (5 * turn);
+            timeout.job = i;
+            timeout.reqId = 0;
+            wheel.add(timeout);
+            pending.push_back(timeout);
+        }
+        else {
+            now += r % 4 == 0 ? r % (2 * turn) : r % 40;
+            expired.clear();
+            wheel.expire(now, expired);
+
+            for (ReqTimeout& timeout : expired) {
+                auto it = std::find_if(pending.begin(), pending.end(), [&](const ReqTimeout& t) { return t.job == timeout.job; });
+                if (it == pending.end() || timeout.deadline > now) {
+                    wheelErrors++;
+                    continue;
+                }
+                pending.erase(it);
+            }
+        }
+
+        // nothing due was left behind
+        uint64_t earliest = 0;
+        for (ReqTimeout& timeout : pending) {
+            earliest = !earliest || timeout.deadline < earliest ? timeout.deadline : earliest;
+        }
+        if (i % 3 == 2 && earliest && earliest <= now) {
+            wheelErrors++;
+        }
+        if (wheel.nextDeadline() != earliest || wheel.empty() != pending.empty()) {
+            wheelErrors++;
+        }
+    }
+
+    if (wheelErrors) {
+        printf("FAIL: %d timer wheel timeouts fired at the wrong time\n", wheelErrors);
+        failures++;
+    }
+    else {
+        printf("PASS: timer wheel timeouts fired on time, including ones that wrap around the wheel\n");
+    }
+
+    // A request that times out is sent again, then the server responds. Only the timeout of the
+    // request that's still waiting is acted on.
+    QueryJob job;
+    job.state = QJ_WAIT_PLAYERS;
+    job.reqId = 1;
+    ReqTimeout first = { 100, 0, job.reqId };
+
+    bool staleOk = !isStaleTimeout(job, first);
+    job.reqId++; // sent again
+    ReqTimeout second = { 200, 0, job.reqId };
+    staleOk = staleOk && isStaleTimeout(job, first) && !isStaleTimeout(job, second);
+
+    job.state = QJ_DONE; // responded
+    staleOk = staleOk && isStaleTimeout(job, second);
+
+    if (!staleOk) {
+        printf("FAIL: stale request timeouts weren't ignored\n");
+        failures++;
+    }
+    else {
+        printf("PASS: timeouts of requests that were sent again or answered were ignored\n");
+    }
+
+    return failures ? 1 : 0;
+}
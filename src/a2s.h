@@ -1,3 +1,8 @@
 bool a2s_init();
 void a2s_cleanup();
-void a2s_query_all();
\ No newline at end of file
+
+// queries the player lists of all servers. Server info is queried first if queryInfo is set.
+void a2s_query_all(bool queryInfo = false);
+
+// checks the joining of split responses, the parsing of player lists and request timeouts. Returns 0 if it passed.
+int a2s_test();
\ No newline at end of file
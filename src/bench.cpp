@@ -0,0 +1,279 @@
+#include "bench.h"
+#include "main.h"
+#include "util.h"
+#include "statdecode.h"
+#include "statblock.h"
+#include <random>
+
+string benchPath = "bench/";
+uint32_t g_benchEndTime = 0; // all generated stats are before this time
+
+struct DecodeResult {
+	uint64_t records = 0;
+	uint64_t bytes = 0;
+	uint64_t checksum = 0;
+	uint64_t playerSeconds = 0;
+};
+
+// writes a stat file with a record every few minutes, like a busy server
+bool writeBenchStatFile(string path, int years, uint32_t seed, uint64_t& numRecords) {
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		printf("Failed to create bench file: %s\n", path.c_str());
+		return false;
+	}
+
+	writeStatHeader(file, statFileMagicBytes, path);
+
+	std::mt19937 rng(seed);
+	uint32_t now = getEpochSeconds();
+	uint32_t time = now - years * 60 * 60 * 24 * 365;
+	uint32_t lastTime = 0;
+	int players = 0;
+	vector<uint8_t> data;
+
+	while (time < now) {
+		uint32_t delta = time - lastTime;
+		bool unreachable = rng() % 500 == 0;
+		uint8_t timeFlag = delta > 65535 ? FL_PCNT_TIME32 : delta > 255 ? FL_PCNT_TIME16 : 0;
+
+		// players join and leave a few at a time
+		players = std::min(32, std::max(0, players + (int)(rng() % 7) - 3));
+		uint8_t stat = unreachable ? (PCNT_UNREACHABLE | (timeFlag >> 2)) : (timeFlag | players);
+
+		data.push_back(stat);
+		if (timeFlag & FL_PCNT_TIME32) {
+			data.insert(data.end(), (uint8_t*)&time, (uint8_t*)&time + sizeof(uint32_t));
+		}
+		else if (timeFlag & FL_PCNT_TIME16) {
+			data.insert(data.end(), (uint8_t*)&delta, (uint8_t*)&delta + sizeof(uint16_t));
+		}
+		else {
+			data.push_back(delta);
+		}
+
+		numRecords++;
+		lastTime = time;
+		time += rng() % 20 == 0 ? 60 * (5 + rng() % 60) : 60 * (1 + rng() % 3);
+	}
+
+	bool success = fwrite(&data[0], data.size(), 1, file) == 1;
+	fclose(file);
+	return success;
+}
+
+// the original decoding loop, which calls fread for every field of every record
+bool decodeFread(string path, DecodeResult& result) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+
+	StatFileHeader header;
+	if (!fread(&header, sizeof(StatFileHeader), 1, file)) {
+		fclose(file);
+		return false;
+	}
+
+	uint32_t statTime = 0;
+
+	while (1) {
+		uint8_t stat;
+		if (!fread(&stat, sizeof(uint8_t), 1, file)) {
+			break;
+		}
+		uint8_t flags = stat & PCNT_FL_MASK;
+		uint8_t playerCount = 0;
+
+		if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
+			flags = (stat << 2) & PCNT_FL_MASK;
+		}
+		else {
+			playerCount = stat & ~PCNT_FL_MASK;
+		}
+
+		if (flags & FL_PCNT_TIME32) {
+			if (!fread(&statTime, sizeof(uint32_t), 1, file)) {
+				break;
+			}
+		}
+		else if (flags & FL_PCNT_TIME16) {
+			uint16_t delta;
+			if (!fread(&delta, sizeof(uint16_t), 1, file)) {
+				break;
+			}
+			statTime += delta;
+		}
+		else {
+			uint8_t delta;
+			if (!fread(&delta, sizeof(uint8_t), 1, file)) {
+				break;
+			}
+			statTime += delta;
+		}
+
+		result.records++;
+		result.checksum += statTime + playerCount;
+	}
+
+	result.bytes += ftell(file);
+	fclose(file);
+	return true;
+}
+
+bool decodeMapped(string path, DecodeResult& result) {
+	MappedFile file;
+	if (!file.open(path) || file.size < sizeof(StatFileHeader)) {
+		return false;
+	}
+
+	StatCursor cursor = file.cursor(sizeof(StatFileHeader));
+
+	bool success = decodeStats(cursor, [&](const StatRecord& rec) {
+		result.records++;
+		result.checksum += rec.time + rec.players;
+		return true;
+	});
+
+	if (!success) {
+		return false;
+	}
+
+	result.bytes += cursor.tell();
+	return true;
+}
+
+// decodes every stat in a v2 file, and integrates the player counts
+bool decodeBlocks(string path, DecodeResult& result) {
+	MappedFile file;
+	if (!file.open(path) || file.size < sizeof(StatFileHeader)) {
+		return false;
+	}
+
+	StatCursor cursor = file.cursor(sizeof(StatFileHeader));
+	StatSample last;
+	last.time = 0;
+
+	bool success = decodeStatBlocks(cursor, [&](const StatRecord& rec) {
+		if (last.time) {
+			result.playerSeconds += (uint64_t)last.players * (rec.time - last.time);
+		}
+		last = rec;
+		result.records++;
+		result.checksum += rec.time + rec.players;
+		return true;
+	});
+
+	if (!success) {
+		return false;
+	}
+
+	if (last.time) {
+		result.playerSeconds += (uint64_t)last.players * (g_benchEndTime - last.time);
+	}
+
+	result.bytes += cursor.tell();
+	return true;
+}
+
+// integrates the player counts of a v2 file using only the block headers
+bool decodeSummary(string path, DecodeResult& result) {
+	MappedFile file;
+	if (!file.open(path) || file.size < sizeof(StatFileHeader)) {
+		return false;
+	}
+
+	StatSummary summary;
+	if (!summarizeStats(file, 0, g_benchEndTime, summary)) {
+		return false;
+	}
+
+	result.records += summary.count;
+	result.playerSeconds += summary.playerSeconds;
+	result.bytes += getStatBlockCount(file) * sizeof(StatBlockHeader);
+	return true;
+}
+
+typedef bool (*decode_func)(string path, DecodeResult& result);
+
+bool runDecodePass(const char* desc, decode_func decode, vector<string>& paths, DecodeResult& result) {
+	uint64_t startTime = getEpochMicros();
+
+	for (string& path : paths) {
+		if (!decode(path, result)) {
+			printf("Failed to decode: %s\n", path.c_str());
+			return false;
+		}
+	}
+
+	float seconds = (getEpochMicros() - startTime) / 1000000.0f;
+	printf("%-8s %8.3fs %12.0f records/s %8.1f MB/s\n", desc, seconds,
+		result.records / seconds, result.bytes / (1024.0f * 1024.0f) / seconds);
+	return true;
+}
+
+int bench_decode(int numServers, int years) {
+	if (!dirExists(benchPath) && !createDir(benchPath)) {
+		printf("Failed to create folder: %s\n", benchPath.c_str());
+		return 1;
+	}
+
+	vector<string> paths;
+	uint64_t numRecords = 0;
+
+	printf("Generating %d stat files with %d years of history...\n", numServers, years);
+	for (int i = 0; i < numServers; i++) {
+		string path = benchPath + "bench_" + to_string(i) + ".dat";
+		if (!writeBenchStatFile(path, years, i, numRecords)) {
+			return 1;
+		}
+		paths.push_back(path);
+	}
+	g_benchEndTime = getEpochSeconds() + 1;
+
+	DecodeResult warmup;
+	runDecodePass("warmup", decodeMapped, paths, warmup);
+
+	DecodeResult before;
+	DecodeResult after;
+	bool success = runDecodePass("fread", decodeFread, paths, before)
+		&& runDecodePass("mapped", decodeMapped, paths, after);
+
+	if (success && (before.records != numRecords || after.records != numRecords || before.checksum != after.checksum)) {
+		printf("Decoder mismatch! %llu / %llu / %llu records\n", (unsigned long long)numRecords,
+			(unsigned long long)before.records, (unsigned long long)after.records);
+		success = false;
+	}
+
+	// same stats in the v2 format, then aggregated from the block headers
+	uint64_t upgradeStartTime = getEpochMicros();
+	for (int i = 0; i < (int)paths.size() && success; i++) {
+		bool upgraded = false;
+		success = upgradeStatFile(paths[i], upgraded) && upgraded;
+	}
+	if (success) {
+		printf("Upgraded to v%d in %.3fs\n", STAT_HISTORY_VERSION, (getEpochMicros() - upgradeStartTime) / 1000000.0f);
+	}
+
+	DecodeResult blocks;
+	DecodeResult summary;
+	success = success && runDecodePass("blocks", decodeBlocks, paths, blocks)
+		&& runDecodePass("summary", decodeSummary, paths, summary);
+
+	if (success && (blocks.records != numRecords || blocks.checksum != after.checksum)) {
+		printf("Block decoder mismatch! %llu / %llu records\n", (unsigned long long)numRecords,
+			(unsigned long long)blocks.records);
+		success = false;
+	}
+	if (success && (summary.records != numRecords || summary.playerSeconds != blocks.playerSeconds)) {
+		printf("Block summary mismatch! %llu / %llu player seconds\n", (unsigned long long)blocks.playerSeconds,
+			(unsigned long long)summary.playerSeconds);
+		success = false;
+	}
+
+	for (string& path : paths) {
+		remove(path.c_str());
+	}
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// generates a synthetic stat history corpus and compares stat decoding speeds
+int bench_decode(int numServers, int years);
@@ -11,8 +11,18 @@
 #include <algorithm>
 #include <queue>
 #include <unordered_map>
+#include <list>
 #include "main.h"
+#include "statdecode.h"
+#include "statblock.h"
 #include "a2s.h"
+#include "wal.h"
+#include "rank.h"
+#include "bench.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 using namespace std;
 using namespace rapidjson;
@@ -32,11 +42,14 @@ string avgDataPath = "data/stats/avg/"; // all stats but averaged for better spe
 string archivePath = "data/stats/archive/"; // stats for dead servers that maybe should be deleted
 string rankHistoryPath = "data/stats/rank/"; // past server rankings
 string archiveRankPath = "data/stats/archive/rank/"; // archived because ranking formula may change
+string rttDataPath = "data/stats/rtt/"; // round trip times measured by A2S queries
+string archiveRttPath = "data/stats/archive/rtt/"; // round trip times for dead servers
 string serverInfoPath = "data/tracker.json"; // current server/tracker status
 string ipInfoPath = "data/ipinfo.json"; // ip info cache
 
 const char* statFileMagicBytes = "SVTK";
 const char* rankFileMagicBytes = "SVRK";
+const char* rttFileMagicBytes = "SVRT";
 
 struct ServerIpInfo {
 	string country;
@@ -46,6 +59,9 @@ struct ServerIpInfo {
 
 unordered_map<string, ServerIpInfo> ip_cache;
 
+bool g_statWalMode = false; // write stats to a WAL which is compacted into the stat files in the background
+bool g_directQueryMode = false; // sample servers with A2S_INFO and only fetch the server list to find new servers
+
 //#define DEBUG_MODE
 
 #ifdef DEBUG_MODE
@@ -62,34 +78,20 @@ unordered_map<string, ServerIpInfo> ip_cache;
 	#define RANK_FREQ 60*60 // How often to compute server rankings
 #endif
 
-#define STAT_FILE_VERSION 1
-#define RANK_STAT_MAX_AGE 60*60*24*14 // ignore stats older than this when computing ranks
-#define RANK_STAT_INTERVAL 60 // gaps between rank data points
-#define TOTAL_RANK_DATA_POINTS ((RANK_STAT_MAX_AGE) / (RANK_STAT_INTERVAL))
+#define RANK_STAT_MAX_AGE (g_rankWindows[RANK_WINDOW_LONGEST].length) // ignore stats older than this when computing ranks
 
 #define MAX_LIVE_STATS_AGE_RAW 60*60*24*30 // max number of raw stats written to live data for the web
+#define LIVE_STATS_TRIM_SLACK 60*60*24 // live files can hold stats this much older before they are rewritten
 #define AVG_STAT_FILE_INTERVAL 60*60 // interval for averaged stats
 
 #define IP_CACHE_MAX_DAYS 30 // number of days to cache ip info
 
-#pragma pack(push, 1)
-struct StatFileHeader {
-	uint32_t version;
-	char magic[4]; // "SVTK" for stat files or "SVRK" for ranking files 
-};
-
-#define FL_PCNT_TIME16 64		// time delta is 16 bits and relative to the last stat
-#define FL_PCNT_TIME32 128		// time is a 32 bit absoulte value
-#define PCNT_FL_MASK (FL_PCNT_TIME16|FL_PCNT_TIME32)
-#define PCNT_UNREACHABLE (PCNT_FL_MASK) // if both are set, the server is unreachable
-// if neither are set, time delta is 8-bits and relative to the last stat
-
-#define FL_RANK_RANK16 64		// ranking is not a delta and so does not fit in this byte
-#define FL_RANK_TIME32 128		// time delta is 32 bits instead of 16
-#define FL_RANK_MASK (FL_RANK_RANK16|FL_RANK_TIME32)
-#define RANK_SIGN_BIT 32		// bit containing the sign of the delta
+#define STAT_FILE_CACHE_SIZE 8192 // max stat files kept open between writes (history + live + avg for every changed server)
+#define STAT_FILE_RESERVED 256 // file handles left for sockets, loaded stat files, and the server list
+#define STAT_FILE_CACHE_MIN 16 // stat files aren't kept open if fewer than this can be
 
-#pragma pack(pop)
+#define SERVER_LIST_FREQ (60*10) // how often to fetch the server list in direct query mode
+#define RTT_STAT_FREQ (60*10) // how often to write round trip time stats
 
 #define FL_SERVER_DEDICATED 1
 #define FL_SERVER_SECURE 2
@@ -108,15 +110,51 @@ void ServerState::init() {
 	lastResponseTime = 0;
 	maxPlayers = 0;
 	bots = 0;
-	rankSum = 0;
-	lastRank = -1;
-	a2s_players.clear();
+	initRankWindow();
+	liveFilesValid = false;
+	liveStartTime = 0;
+	avgStartTime = 0;
+	lastAvgStatWrite = 0;
+	avgHistory.clear();
+	a2s_playerList = 0;
+	a2s_firstPlayer = 0;
+	a2s_numPlayers = 0;
+	a2s_success = false;
+	a2s_challenge = 0;
+	a2s_info_success = false;
+	a2s_rttMin = 0;
+	a2s_rttMedian = 0;
+	rttStatStart = 0;
+	lastRttWrite = 0;
+	rttMin = 0;
+	numRttMedians = 0;
+}
+
+void ServerState::initRankWindow() {
+	uint32_t lengths[NUM_RANK_WINDOWS];
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		lengths[w] = g_rankWindows[w].length;
+		rankSums[w] = 0;
+		rankScores[w] = 0;
+	}
+	rankWindow.init(lengths, NUM_RANK_WINDOWS, RANK_STAT_INTERVAL);
+	rankHours.init(RANK_STAT_MAX_AGE, RANK_STAT_INTERVAL);
+}
+
+void ServerState::updateRankSums(uint32_t now) {
+	rankWindow.advance(now);
+	rankHours.advance(now);
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		rankSums[w] = rankWindow.sum(w);
+	}
 }
 
 struct WriteStats {
 	int bytesWritten = 0;
 	int serversUpdated = 0;
 	int bytesRead = 0;
+	int filesFlushed = 0; // files written to when the stat write set was flushed
+	uint64_t flushMicros = 0; // time spent flushing the stat write set
 };
 
 WriteStats g_writeStats;
@@ -154,6 +192,14 @@ string ServerState::getRankArchiveFilePath() {
 	return archiveRankPath + addr + ".dat";
 }
 
+string ServerState::getRttStatFilePath() {
+	return rttDataPath + addr + ".dat";
+}
+
+string ServerState::getRttArchiveFilePath() {
+	return archiveRttPath + addr + ".dat";
+}
+
 uint32_t ServerState::secondsSinceLastResponse() {
 	return getEpochSeconds() - lastResponseTime;
 }
@@ -385,18 +431,15 @@ bool parseProgramServerJson(Value& json, ServerState& state) {
 }
 
 // will unarchive the stat file if it exists, and validate the header
-FILE* loadStatFile(ServerState& state) {
+bool loadStatFile(ServerState& state, MappedFile& file, uint32_t& version) {
 	string fpath = state.getStatFilePath();
 	string archivePath = state.getStatArchiveFilePath();
 
-	FILE* file = NULL;
-
 	if (fileExists(fpath)) {
 		errno = 0;
-		file = fopen(fpath.c_str(), "rb");
-		if (!file) {
+		if (!file.open(fpath)) {
 			printf("Failed to open stat file (%d): %s\n", errno, fpath.c_str());
-			return NULL;
+			return false;
 		}
 	}
 	else if (fileExists(archivePath)) {
@@ -404,206 +447,93 @@ FILE* loadStatFile(ServerState& state) {
 		errno = 0;
 		if (rename(archivePath.c_str(), fpath.c_str()) == -1) {
 			printf("Unarchive failed. Rename error %d: %s", errno, archivePath.c_str());
-			return NULL;
+			return false;
 		}
 
 		errno = 0;
-		file = fopen(fpath.c_str(), "rb");
-		if (!file) {
+		if (!file.open(fpath)) {
 			printf("Failed to open stat file (%d): %s\n", errno, archivePath.c_str());
-			return NULL;
+			return false;
 		}
 	}
 	else {
 		printf("Stat file does not exist for: %s\n", state.addr.c_str());
-		return NULL;
+		return false;
 	}
 
 	StatFileHeader header;
+	StatCursor cursor = file.cursor();
 
-	errno = 0;
-	if (!fread(&header, sizeof(StatFileHeader), 1, file)) {
-		printf("Failed to read stat file (error %d): %s\n", errno, fpath.c_str());
-		fclose(file);
-		return NULL;
+	if (!cursor.read(header)) {
+		printf("Failed to read stat file header: %s\n", fpath.c_str());
+		file.close();
+		return false;
 	}
 
-	if (header.version != STAT_FILE_VERSION) {
+	if (header.version != STAT_FILE_VERSION && header.version != STAT_HISTORY_VERSION) {
 		printf("Bad version %d in stat file: %s\n", header.version, fpath.c_str());
-		fclose(file);
-		return NULL;
+		file.close();
+		return false;
 	}
 
 	if (strncmp(header.magic, statFileMagicBytes, 4)) {
 		string magic = string(header.magic, 4);
 		printf("Bad magic bytes '%s' in stat file: %s\n", magic.c_str(), fpath.c_str());
-		fclose(file);
-		return NULL;
-	}
-
-	return file;
-}
-
-// will unarchive the rank file if it exists, and validate the header
-FILE* loadRankFile(ServerState& state) {
-	string fpath = state.getRankHistFilePath();
-	string archivePath = state.getRankArchiveFilePath();
-
-	FILE* file = NULL;
-
-	if (fileExists(fpath)) {
-		errno = 0;
-		file = fopen(fpath.c_str(), "rb");
-		if (!file) {
-			printf("Failed to open rank file (%d): %s\n", errno, fpath.c_str());
-			return NULL;
-		}
-	}
-	else if (fileExists(archivePath)) {
-		printf("Unarchive rank file: %s\n", state.addr.c_str());
-		errno = 0;
-		if (rename(archivePath.c_str(), fpath.c_str()) == -1) {
-			printf("Unarchive rank failed. Rename error %d: %s", errno, archivePath.c_str());
-			return NULL;
-		}
-
-		errno = 0;
-		file = fopen(fpath.c_str(), "rb");
-		if (!file) {
-			printf("Failed to open rank file (%d): %s\n", errno, archivePath.c_str());
-			return NULL;
-		}
-	}
-	else {
-		printf("Rank file does not exist for: %s\n", state.addr.c_str());
-		return NULL;
-	}
-
-	StatFileHeader header;
-
-	errno = 0;
-	if (!fread(&header, sizeof(StatFileHeader), 1, file)) {
-		printf("Failed to read rank file (error %d): %s\n", errno, fpath.c_str());
-		fclose(file);
-		return NULL;
-	}
-
-	if (header.version != STAT_FILE_VERSION) {
-		printf("Bad version %d in rank file: %s\n", header.version, fpath.c_str());
-		fclose(file);
-		return NULL;
-	}
-
-	if (strncmp(header.magic, rankFileMagicBytes, 4)) {
-		string magic = string(header.magic, 4);
-		printf("Bad magic bytes '%s' in rank file: %s\n", magic.c_str(), fpath.c_str());
-		fclose(file);
-		return NULL;
+		file.close();
+		return false;
 	}
 
-	return file;
+	version = header.version;
+	return true;
 }
 
-
 // false indicates a problem with the file
 bool loadServerHistory(ServerState& state, uint32_t now, bool programRestarted) {
-	FILE* file = loadStatFile(state);
-	if (!file) {
+	MappedFile file;
+	uint32_t version = 0;
+	if (!loadStatFile(state, file, version)) {
 		return false;
 	}
-
 	string dispName = state.displayName();
 	//printf("History for %s\n", dispName.c_str());
 
+	// the rank window is kept up to date by writeServerStat after this
 	uint32_t rankStartTime = now - RANK_STAT_MAX_AGE;
-	uint32_t nextRankTime = rankStartTime;
-	state.rankSum = 0;
-	uint32_t rankDataPoints = 0;
+	state.initRankWindow();
 
 	state.players = 0;
 
-	while (1) {
-		uint8_t stat;
-		if (!fread(&stat, sizeof(uint8_t), 1, file)) {
-			break;
-		}
-		uint8_t flags = stat & PCNT_FL_MASK;
-		uint8_t newPlayerCount = 0;
-
-		if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
-			newPlayerCount = 0;
-			state.unreachable = true;
-			flags = (stat << 2) & PCNT_FL_MASK;
-			if (stat & 0x0f) {
-				printf("Invalid flags in unreachable byte %X\n", (int)stat);
-			}
-		}
-		else {
-			state.unreachable = false;
-			newPlayerCount = stat & ~PCNT_FL_MASK;
-			if (state.players > 32) {
-				printf("Invalid player count\n");
-			}
-		}
+	// Stats before the rank period only matter for the player count at the start of it.
+	// v2 blocks start with an absolute time, so decoding can start from any block.
+	// v1 files are decoded from the start, until their first write upgrades them.
+	size_t startOffset = sizeof(StatFileHeader);
+	if (version == STAT_HISTORY_VERSION) {
+		startOffset = findStatBlock(file, rankStartTime);
+	}
 
-		int dt = 0;
+	StatCursor cursor = file.cursor(startOffset);
 
-		if (flags & FL_PCNT_TIME32) {
-			uint32_t newTime = 0;
-			if (!fread(&newTime, sizeof(uint32_t), 1, file)) {
-				printf("Failed to read stat time\n");
-				return false;
-			}
-			state.lastWriteTime = newTime;
-		}
-		else if (flags & FL_PCNT_TIME16) {
-			uint16_t delta;
-			if (!fread(&delta, sizeof(uint16_t), 1, file)) {
-				printf("Failed to read stat time\n");
-				return false;
-			}
-			state.lastWriteTime += delta;
-			dt = delta;
-		}
-		else {
-			uint8_t delta;
-			if (!fread(&delta, sizeof(uint8_t), 1, file)) {
-				printf("Failed to read stat time\n");
-				return false;
-			}
-			state.lastWriteTime += delta;
-			dt = delta;
-		}
+	bool validStats = decodeStatHistory(cursor, version, [&](const StatRecord& rec) {
+		state.lastWriteTime = rec.time;
+		state.rankWindow.add(rec.time, rec.players);
+		state.rankHours.add(rec.time, rec.players, rec.unreachable);
 
-		int backfills = 0;
-		while (state.lastWriteTime >= nextRankTime) { // back-fill gaps in data with last known player count
-			state.rankSum += state.players;
-			rankDataPoints++;
-			backfills++;
-			nextRankTime = rankStartTime + rankDataPoints * RANK_STAT_INTERVAL;
-		}
+		state.players = rec.players;
+		state.unreachable = rec.unreachable;
 
-		state.players = newPlayerCount;
+		//printf("Time %u, count %d, unreachable %d\n", state.lastWriteTime, (int)state.players, (int)state.unreachable);
+		return true;
+	});
 
-		//printf("Time %u, delta %d, count %d, unreachable %d\n", state.lastWriteTime, dt, (int)state.players, (int)state.unreachable);
+	if (!validStats) {
+		return false;
 	}
 
 	// now catch up to the current time
-	int backfills = 0;
-	while (now >= nextRankTime) { // back-fill gaps in data with last known player count
-		state.rankSum += state.players;
-		rankDataPoints++;
-		backfills++;
-		nextRankTime = rankStartTime + rankDataPoints * RANK_STAT_INTERVAL;
-	}
-	rankDataPoints--;
-	if (rankDataPoints != TOTAL_RANK_DATA_POINTS) {
-		state.rankSum = 0;
-		printf("Unexpected rank data points %u / %u\n", rankDataPoints, TOTAL_RANK_DATA_POINTS);
-	}
+	state.updateRankSums(now);
 
-	g_writeStats.bytesRead += ftell(file);
-	fclose(file);
+	g_writeStats.bytesRead += cursor.tell() - startOffset;
+	file.close();
 
 	if (state.lastWriteTime > now) {
 		printf("Parsed invalid time +%u\n", state.lastWriteTime - now);
@@ -630,9 +560,9 @@ bool loadServerHistory(ServerState& state, uint32_t now, bool programRestarted)
 	return true;
 }
 
-bool writeStatHeader(FILE* file, const char* magic, string fpath) {
+bool writeStatHeader(FILE* file, const char* magic, string fpath, uint32_t version) {
 	StatFileHeader header;
-	header.version = STAT_FILE_VERSION;
+	header.version = version;
 	memcpy(header.magic, magic, 4);
 
 	errno = 0;
@@ -665,38 +595,297 @@ uint8_t getDeltaFlags(uint32_t timeDelta) {
 	}
 }
 
-bool writeDelta(uint32_t timeFrom, uint32_t timeTo, FILE* file) {
+void writeDelta(uint32_t timeFrom, uint32_t timeTo, vector<uint8_t>& out) {
 	uint32_t timeDelta = timeTo - timeFrom;
 	uint8_t flags = getDeltaFlags(timeDelta);
 
 	if (flags & FL_PCNT_TIME32) {
-		if (!fwriteVerbose(&timeTo, sizeof(uint32_t), file, "time delta")) {
-			return false;
-		}
+		out.insert(out.end(), (uint8_t*)&timeTo, (uint8_t*)&timeTo + sizeof(uint32_t));
 	}
 	else if (flags & FL_PCNT_TIME16) {
-		if (!fwriteVerbose(&timeDelta, sizeof(uint16_t), file, "time delta")) {
-			return false;
+		out.insert(out.end(), (uint8_t*)&timeDelta, (uint8_t*)&timeDelta + sizeof(uint16_t));
+	}
+	else {
+		out.push_back(timeDelta);
+	}
+}
+
+// encodes a stat in the v1 delta format used by live/avg files. A prevTime of 0 writes the full time.
+int encodeStat(uint32_t prevTime, const StatSample& stat, uint8_t* out) {
+	uint32_t timeDelta = stat.time - prevTime;
+	uint8_t timeFlag = getDeltaFlags(timeDelta);
+
+	if (stat.unreachable) {
+		// player count unknown, so use the unused bits for more flags
+		out[0] = PCNT_UNREACHABLE | (timeFlag >> 2);
+	}
+	else {
+		out[0] = timeFlag | (stat.players < STAT_V1_MAX_PLAYERS ? stat.players : STAT_V1_MAX_PLAYERS);
+	}
+
+	int len = 1;
+
+	if (timeFlag & FL_PCNT_TIME32) {
+		memcpy(out + len, &stat.time, sizeof(uint32_t));
+		len += sizeof(uint32_t);
+	}
+	else if (timeFlag & FL_PCNT_TIME16) {
+		uint16_t delta = timeDelta;
+		memcpy(out + len, &delta, sizeof(uint16_t));
+		len += sizeof(uint16_t);
+	}
+	else {
+		out[len++] = timeDelta;
+	}
+
+	return len;
+}
+
+struct PendingWrite {
+	string addr; // server the file belongs to
+	vector<uint8_t> data;
+};
+
+// file path -> bytes to append to live/avg/rtt files when the write set is flushed
+unordered_map<string, PendingWrite> g_pendingWrites;
+
+// server id -> stats to append to the stat history file when the write set is flushed.
+// Stats that fail to write stay here until a later flush succeeds.
+unordered_map<string, vector<StatSample>> g_pendingStats;
+
+// server id -> time of the newest stat, for live/avg files that need work after the write set is flushed
+unordered_map<string, uint32_t> g_pendingLiveRebuilds;
+unordered_map<string, uint32_t> g_pendingLiveTrims;
+
+struct CachedStatFile {
+	FILE* file;
+	StatBlockWriter* history; // used instead of file for stat history files
+	list<string>::iterator lruPos; // position in g_statFileLru
+};
+
+// open handles for recently written stat files, so that hot servers aren't reopened every write
+unordered_map<string, CachedStatFile> g_statFileCache;
+list<string> g_statFileLru; // cached file paths, most recently written first
+size_t g_statFileCacheSize = STAT_FILE_CACHE_SIZE; // lowered if the process can't open that many files
+
+// sizes the stat file cache to the number of files this process is allowed to open
+void initStatFileCache() {
+#ifdef _WIN32
+	g_statFileCacheSize = 512 - STAT_FILE_RESERVED; // default C runtime stream limit
+#else
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit)) {
+		return;
+	}
+
+	if (limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit)) {
+			getrlimit(RLIMIT_NOFILE, &limit);
 		}
 	}
+
+	if (limit.rlim_cur < STAT_FILE_CACHE_MIN + STAT_FILE_RESERVED) {
+		g_statFileCacheSize = 0;
+		printf("Open file limit is %d. Stat files are closed after every write.\n", (int)limit.rlim_cur);
+	}
+	else if (limit.rlim_cur < STAT_FILE_CACHE_SIZE + STAT_FILE_RESERVED) {
+		g_statFileCacheSize = limit.rlim_cur - STAT_FILE_RESERVED;
+		printf("Open file limit is %d. Caching at most %d stat files.\n", (int)limit.rlim_cur, (int)g_statFileCacheSize);
+	}
+#endif
+}
+
+void closeCachedStatFile(CachedStatFile& cached) {
+	if (cached.history) {
+		delete cached.history; // flushes and closes the file
+	}
 	else {
-		if (!fwriteVerbose(&timeDelta, sizeof(uint8_t), file, "time delta")) {
+		fclose(cached.file);
+	}
+}
+
+void closeCachedStatFile(const string& path) {
+	auto item = g_statFileCache.find(path);
+	if (item != g_statFileCache.end()) {
+		closeCachedStatFile(item->second);
+		g_statFileLru.erase(item->second.lruPos);
+		g_statFileCache.erase(item);
+	}
+}
+
+// closes every cached file
+void closeCachedStatFiles() {
+	for (auto& item : g_statFileCache) {
+		closeCachedStatFile(item.second);
+	}
+	g_statFileCache.clear();
+	g_statFileLru.clear();
+}
+
+// makes room in the cache for another file. With caching off, only one file is open at a time.
+void evictCachedStatFile() {
+	if (g_statFileCache.empty() || g_statFileCache.size() < g_statFileCacheSize) {
+		return;
+	}
+
+	// close the least recently written file
+	string oldest = g_statFileLru.back();
+	closeCachedStatFile(oldest);
+}
+
+// marks a cached file as the most recently written
+void touchCachedStatFile(CachedStatFile& cached) {
+	g_statFileLru.splice(g_statFileLru.begin(), g_statFileLru, cached.lruPos);
+}
+
+void addCachedStatFile(const string& path, FILE* file, StatBlockWriter* history) {
+	CachedStatFile cached;
+	cached.file = file;
+	cached.history = history;
+	cached.lruPos = g_statFileLru.insert(g_statFileLru.begin(), path);
+	g_statFileCache[path] = cached;
+}
+
+// opens a stat history file for appending, upgrading it to the latest version first
+bool openStatWriter(ServerState& state, StatBlockWriter& writer) {
+	string fpath = state.getStatFilePath();
+	bool upgraded = false;
+
+	if (!upgradeStatFile(fpath, upgraded)) {
+		return false;
+	}
+
+	if (upgraded) {
+		printf("Upgraded stat file to v%d: %s\n", STAT_HISTORY_VERSION, state.addr.c_str());
+	}
+
+	return writer.open(fpath);
+}
+
+StatBlockWriter* getCachedStatWriter(ServerState& state) {
+	string path = state.getStatFilePath();
+
+	auto item = g_statFileCache.find(path);
+	if (item != g_statFileCache.end()) {
+		touchCachedStatFile(item->second);
+		return item->second.history;
+	}
+
+	evictCachedStatFile();
+
+	StatBlockWriter* writer = new StatBlockWriter();
+	if (!openStatWriter(state, *writer)) {
+		delete writer;
+		return NULL;
+	}
+
+	addCachedStatFile(path, NULL, writer);
+	return writer;
+}
+
+FILE* getCachedStatFile(const string& path) {
+	auto item = g_statFileCache.find(path);
+	if (item != g_statFileCache.end()) {
+		touchCachedStatFile(item->second);
+		return item->second.file;
+	}
+
+	evictCachedStatFile();
+
+	errno = 0;
+	FILE* file = fopen(path.c_str(), "ab");
+	if (!file) {
+		printf("Failed to reopen stat file (error %d): %s\n", errno, path.c_str());
+		return NULL;
+	}
+
+	addCachedStatFile(path, file, NULL);
+	return file;
+}
+
+void queueStatWrite(ServerState& state, const string& path, const uint8_t* data, int len) {
+	PendingWrite& pending = g_pendingWrites[path];
+	pending.addr = state.addr;
+	pending.data.insert(pending.data.end(), data, data + len);
+}
+
+// converts a delta stat byte to one that is followed by a 32-bit absolute time
+uint8_t getAbsoluteStat(uint8_t stat) {
+	if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
+		return PCNT_UNREACHABLE | (FL_PCNT_TIME32 >> 2);
+	}
+	return FL_PCNT_TIME32 | (stat & ~PCNT_FL_MASK);
+}
+
+// adds a stat to the running average, and writes an averaged stat if enough time has passed
+bool appendAvgStat(ServerState& state, uint32_t statTime, uint8_t playerCount, vector<uint8_t>& avgData) {
+	uint32_t numStatsPerAvg = AVG_STAT_FILE_INTERVAL / STAT_WRITE_FREQ;
+
+	if (state.avgStartTime == 0) {
+		state.avgStartTime = statTime;
+	}
+
+	// samples take the player count of the last stat at or before them,
+	// so every sample before this stat is known now
+	SampleGrid grid(state.avgStartTime, RANK_STAT_INTERVAL);
+	uint32_t numSamples = grid.countBefore(statTime);
+	uint32_t firstSample = numSamples > numStatsPerAvg ? numSamples - numStatsPerAvg : 0;
+
+	uint32_t avgDelta = statTime - state.lastAvgStatWrite;
+	if (avgDelta >= AVG_STAT_FILE_INTERVAL && numSamples >= numStatsPerAvg) {
+		uint8_t avgFlags = getDeltaFlags(avgDelta);
+
+		float total = sumSamples(grid, state.avgHistory, firstSample, numSamples);
+		total /= (float)numStatsPerAvg;
+
+		uint8_t avgCount = (uint8_t)(total + 0.5f);
+		if (avgCount > STAT_V1_MAX_PLAYERS) {
+			printf("Impossible average: %d > %d\n", (int)avgCount, STAT_V1_MAX_PLAYERS);
 			return false;
 		}
+
+		uint8_t avgStat = avgFlags | avgCount;
+
+		avgData.push_back(avgStat);
+		writeDelta(state.lastAvgStatWrite, statTime, avgData);
+
+		state.lastAvgStatWrite = statTime;
+	}
+
+	// later averages never include samples before this one
+	while (state.avgHistory.size() > 1 && grid.countBefore(state.avgHistory[1].time) <= firstSample) {
+		state.avgHistory.pop_front();
 	}
 
+	StatSample stat;
+	stat.time = statTime;
+	stat.players = playerCount < STAT_V1_MAX_PLAYERS ? playerCount : STAT_V1_MAX_PLAYERS;
+	stat.unreachable = false;
+	state.avgHistory.push_back(stat);
 	return true;
 }
 
+// regenerates the live/avg files from the full stat history.
+// Later stats are appended with queueLiveStats.
 bool writeLiveStatFiles(ServerState& state, uint32_t now) {
-	FILE* historyFile = loadStatFile(state);
+	MappedFile historyFile;
+	uint32_t version = 0;
+	bool historyLoaded = loadStatFile(state, historyFile, version);
+	StatCursor cursor = historyFile.cursor(sizeof(StatFileHeader));
+
+	state.liveFilesValid = false;
+	state.liveStartTime = 0;
+	state.avgStartTime = 0;
+	state.lastAvgStatWrite = 0;
+	state.avgHistory.clear();
 
 	string liveDataPath = state.getLiveStatFilePath();
 	string liveAvgDataPath = state.getLiveAvgStatFilePath();
 	FILE* liveFile = fopen(liveDataPath.c_str(), "wb");
 	FILE* avgFile = fopen(liveAvgDataPath.c_str(), "wb");
 
-	if (!liveFile || !avgFile || !historyFile) {
+	if (!liveFile || !avgFile || !historyLoaded) {
 		printf("Failed to write live/avg stats: %s\n", state.addr.c_str());
 		if (liveFile) {
 			fclose(liveFile);
@@ -706,9 +895,6 @@ bool writeLiveStatFiles(ServerState& state, uint32_t now) {
 			fclose(avgFile);
 			remove(liveAvgDataPath.c_str());
 		}
-		if (historyFile) {
-			fclose(historyFile);
-		}
 		return false;
 	}
 
@@ -717,134 +903,46 @@ bool writeLiveStatFiles(ServerState& state, uint32_t now) {
 
 	bool withinLiveStatRange = false;
 	uint32_t statTime = 0;
+	bool validAvg = true;
+	vector<uint8_t> liveData;
+	vector<uint8_t> avgData;
 
-	uint32_t numStatsPerAvg = AVG_STAT_FILE_INTERVAL / STAT_WRITE_FREQ;
-	uint32_t lastAvgStatWrite = 0;
-	uint32_t lastAvgStatTime = 0;
-	uint8_t lastPlayerCount = 0;
-
-	deque<uint8_t> avgHistory;
-	bool success = true;
-
-	while (1) {		
-		uint8_t stat;
-		if (!fread(&stat, sizeof(uint8_t), 1, historyFile)) {
-			break;
-		}
-		uint8_t flags = stat & PCNT_FL_MASK;
-		uint8_t playerCount = 0;
-
-		if (withinLiveStatRange && !fwriteVerbose(&stat, sizeof(uint8_t), liveFile, "live stat")) {
-			success = false;
-			break;
-		}
-
-		if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
-			flags = (stat << 2) & PCNT_FL_MASK;
-			if (stat & 0x0f) {
-				printf("Invalid flags in unreachable byte %X\n", (int)stat);
-			}
-		}
-		else {
-			playerCount = stat & ~PCNT_FL_MASK;
-			if (playerCount > 32) {
-				printf("Invalid player count\n");
-			}
-		}
+	bool success = decodeStatHistory(cursor, version, [&](const StatRecord& rec) {
+		uint32_t prevTime = statTime;
+		statTime = rec.time;
 
-		if (flags & FL_PCNT_TIME32) {
-			if (!fread(&statTime, sizeof(uint32_t), 1, historyFile)) {
-				printf("Failed to read stat time\n");
-				success = false;
-				break;
-			}
-			if (withinLiveStatRange && !fwriteVerbose(&statTime, sizeof(uint32_t), liveFile, "live stat")) {
-				success = false;
-				break;
-			}
-		}
-		else if (flags & FL_PCNT_TIME16) {
-			uint16_t delta;
-			if (!fread(&delta, sizeof(uint16_t), 1, historyFile)) {
-				printf("Failed to read stat time\n");
-				success = false;
-				break;
-			}
-			if (withinLiveStatRange && !fwriteVerbose(&delta, sizeof(uint16_t), liveFile, "live stat")) {
-				success = false;
-				break;
-			}
-			statTime += delta;
-		}
-		else {
-			uint8_t delta;
-			if (!fread(&delta, sizeof(uint8_t), 1, historyFile)) {
-				printf("Failed to read stat time\n");
-				success = false;
-				break;
-			}
-			if (withinLiveStatRange && !fwriteVerbose(&delta, sizeof(uint8_t), liveFile, "live stat")) {
-				success = false;
-				break;
-			}
-			statTime += delta;
+		if (withinLiveStatRange) {
+			uint8_t stat[5];
+			int statLen = encodeStat(prevTime, rec, stat);
+			liveData.insert(liveData.end(), stat, stat + statLen);
 		}
-
-		if (!withinLiveStatRange && statTime > now - MAX_LIVE_STATS_AGE_RAW) {
+		else if (statTime > now - MAX_LIVE_STATS_AGE_RAW) {
 			withinLiveStatRange = true;
+			state.liveStartTime = statTime;
 
 			// first stat should always write the full time
-			uint8_t firstStat = FL_PCNT_TIME32 | playerCount;
-			if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
-				firstStat = PCNT_UNREACHABLE | (FL_PCNT_TIME32 >> 2);
-			}
-
-			fwrite(&firstStat, sizeof(uint8_t), 1, liveFile);
-			fwrite(&statTime, sizeof(uint32_t), 1, liveFile);
+			uint8_t stat[5];
+			int statLen = encodeStat(0, rec, stat);
+			liveData.insert(liveData.end(), stat, stat + statLen);
 		}
 
 		// write averaged data
-		if (lastAvgStatTime == 0) {
-			lastAvgStatTime = statTime;
-		}
-		while (statTime > lastAvgStatTime) { // back-fill gaps
-			avgHistory.push_back(lastPlayerCount);
-			if (avgHistory.size() > numStatsPerAvg) {
-				avgHistory.pop_front();
-			}
-			lastAvgStatTime += RANK_STAT_INTERVAL;
+		if (!appendAvgStat(state, statTime, rec.players, avgData)) {
+			validAvg = false;
+			return false;
 		}
 
-		uint32_t avgDelta = statTime - lastAvgStatWrite;
-		if (avgDelta >= AVG_STAT_FILE_INTERVAL && avgHistory.size() == numStatsPerAvg) {
-			uint8_t avgFlags = getDeltaFlags(avgDelta);
-
-			float total = 0;
-			for (uint8_t count : avgHistory) {
-				total += count;
-			}
-			total /= (float)avgHistory.size();
-
-			uint8_t avgCount = (uint8_t)(total + 0.5f);
-			if (avgCount > 32) {
-				printf("Impossible average: %d > 32\n", (int)avgCount);
-				avgCount = 0;
-				success = false;
-				break;
-			}
-
-			uint8_t avgStat = avgFlags | avgCount;
-
-			fwrite(&avgStat, sizeof(uint8_t), 1, avgFile);
-			writeDelta(lastAvgStatWrite, statTime, avgFile);
+		return true;
+	}) && validAvg;
 
-			lastAvgStatWrite = statTime;
-		}
-
-		lastPlayerCount = playerCount;
+	if (success && liveData.size()) {
+		success = fwriteVerbose(&liveData[0], liveData.size(), liveFile, "live stats");
+	}
+	if (success && avgData.size()) {
+		success = fwriteVerbose(&avgData[0], avgData.size(), avgFile, "avg stats");
 	}
 
-	fclose(historyFile);
+	historyFile.close();
 	fclose(liveFile);
 	fclose(avgFile);
 
@@ -852,10 +950,261 @@ bool writeLiveStatFiles(ServerState& state, uint32_t now) {
 		remove(liveDataPath.c_str());
 		remove(liveAvgDataPath.c_str());
 	}
+	else {
+		state.lastWriteTime = statTime;
+	}
 
+	state.liveFilesValid = success;
 	return success;
 }
 
+// drops stats from the head of the live file that are no longer within the live stat range
+bool trimLiveStatFile(ServerState& state, uint32_t now) {
+	string liveDataPath = state.getLiveStatFilePath();
+	string tempPath = liveDataPath + ".temp";
+
+	MappedFile file;
+	if (!file.open(liveDataPath) || file.size < sizeof(StatFileHeader)) {
+		printf("Failed to load live stats: %s\n", liveDataPath.c_str());
+		state.liveFilesValid = false;
+		return false;
+	}
+
+	StatCursor cursor = file.cursor(sizeof(StatFileHeader));
+	StatRecord firstRec;
+	bool foundStat = false;
+
+	decodeStats(cursor, [&](const StatRecord& rec) {
+		if (rec.time > now - MAX_LIVE_STATS_AGE_RAW) {
+			firstRec = rec;
+			foundStat = true;
+			return false;
+		}
+		return true;
+	});
+
+	if (foundStat) {
+		FILE* liveFile = fopen(tempPath.c_str(), "wb");
+		if (!liveFile) {
+			printf("Failed to open live stat file: %s\n", tempPath.c_str());
+			state.liveFilesValid = false;
+			return false;
+		}
+
+		// first stat should always write the full time
+		uint8_t firstStat = getAbsoluteStat(firstRec.start[0]);
+
+		bool success = writeStatHeader(liveFile, statFileMagicBytes, tempPath)
+			&& fwriteVerbose(&firstStat, sizeof(uint8_t), liveFile, "live stat")
+			&& fwriteVerbose(&firstRec.time, sizeof(uint32_t), liveFile, "live stat")
+			&& (cursor.eof() || fwriteVerbose(cursor.pos, cursor.end - cursor.pos, liveFile, "live stats"));
+		fclose(liveFile);
+		file.close();
+
+		if (success) {
+			remove(liveDataPath.c_str());
+			rename(tempPath.c_str(), liveDataPath.c_str());
+
+			state.liveStartTime = firstRec.time;
+			return true;
+		}
+
+		remove(tempPath.c_str());
+	}
+	else {
+		printf("No stats in live range: %s\n", liveDataPath.c_str());
+	}
+
+	state.liveFilesValid = false; // regenerate on the next write
+	return false;
+}
+
+// encodes the latest stat for the live/avg files, so that the full history doesn't need to be read
+bool encodeLiveStats(ServerState& state, const uint8_t* stat, int statLen, uint32_t now,
+	vector<uint8_t>& liveData, vector<uint8_t>& avgData, bool& needsTrim)
+{
+	if (state.liveStartTime == 0) {
+		// first stat should always write the full time
+		liveData.push_back(getAbsoluteStat(stat[0]));
+		liveData.insert(liveData.end(), (uint8_t*)&now, (uint8_t*)&now + sizeof(uint32_t));
+		state.liveStartTime = now;
+	}
+	else {
+		liveData.insert(liveData.end(), stat, stat + statLen);
+	}
+
+	uint8_t playerCount = 0;
+	if ((stat[0] & PCNT_FL_MASK) != PCNT_UNREACHABLE) {
+		playerCount = stat[0] & ~PCNT_FL_MASK;
+	}
+
+	if (!appendAvgStat(state, now, playerCount, avgData)) {
+		state.liveFilesValid = false;
+		return false;
+	}
+
+	// trimming rewrites the whole file, so wait until a day of stats can be dropped at once
+	needsTrim = state.liveStartTime <= now - (MAX_LIVE_STATS_AGE_RAW + LIVE_STATS_TRIM_SLACK);
+	return true;
+}
+
+bool queueLiveStats(ServerState& state, const uint8_t* stat, int statLen, uint32_t now) {
+	vector<uint8_t> liveData;
+	vector<uint8_t> avgData;
+	bool needsTrim = false;
+
+	if (!encodeLiveStats(state, stat, statLen, now, liveData, avgData, needsTrim)) {
+		g_pendingLiveRebuilds[state.addr] = now;
+		return false;
+	}
+
+	queueStatWrite(state, state.getLiveStatFilePath(), &liveData[0], liveData.size());
+	if (avgData.size()) {
+		queueStatWrite(state, state.getLiveAvgStatFilePath(), &avgData[0], avgData.size());
+	}
+
+	if (needsTrim) {
+		g_pendingLiveTrims[state.addr] = now;
+	}
+
+	return true;
+}
+
+// appends queued bytes to their files
+void flushPendingWrites() {
+	for (auto& item : g_pendingWrites) {
+		vector<uint8_t>& data = item.second.data;
+		if (data.empty()) {
+			continue;
+		}
+
+		FILE* file = getCachedStatFile(item.first);
+		bool success = file != NULL;
+
+		if (success) {
+			errno = 0;
+			if (!fwrite(&data[0], data.size(), 1, file) || fflush(file)) {
+				printf("Stat write failed (error %d): %s\n", errno, item.first.c_str());
+				closeCachedStatFile(item.first);
+				success = false;
+			}
+			g_writeStats.filesFlushed++;
+		}
+
+		auto serv = g_servers.find(item.second.addr);
+		if (success || serv == g_servers.end()) {
+			continue;
+		}
+
+		ServerState& state = serv->second;
+		if (item.first == state.getRttStatFilePath()) {
+			state.lastRttWrite = 0; // the stat is lost, so the next one writes an absolute time
+		}
+		else {
+			// the file may end with part of a stat now, so regenerate it from the history
+			state.liveFilesValid = false;
+			g_pendingLiveRebuilds[state.addr] = getEpochSeconds();
+		}
+	}
+	g_pendingWrites.clear();
+
+	if (!g_statFileCacheSize) {
+		closeCachedStatFiles(); // this is the last write of a flush
+	}
+}
+
+// writes all queued stats, then regenerates/trims live files that were waiting on them.
+// Each changed file costs one write syscall. Batching the appends into io_uring doesn't help:
+// appending 12 bytes to each of 3000 O_APPEND files took 7.3-8.5ms with a write() loop and
+// 11.9-14.1ms with IORING_OP_WRITE submitted 256 at a time (ext4, Linux 6.18), because buffered
+// appends are handed off to io_uring worker threads. A flush every minute costs well under 1%.
+void flushStatWrites() {
+	uint64_t startTime = getEpochMicros();
+
+	if (g_statWalMode) {
+		g_writeStats.filesFlushed += wal_flush() ? 1 : 0;
+		flushPendingWrites(); // round trip time stats aren't in the WAL
+		g_writeStats.flushMicros += getEpochMicros() - startTime;
+		return;
+	}
+
+	unordered_map<string, vector<StatSample>> failedStats;
+
+	for (auto& item : g_pendingStats) {
+		auto serv = g_servers.find(item.first);
+		if (serv == g_servers.end()) {
+			continue;
+		}
+
+		ServerState& state = serv->second;
+		StatBlockWriter* writer = getCachedStatWriter(state);
+		bool success = writer != NULL;
+		uint64_t savedBefore = writer ? writer->savedStats() : 0;
+
+		for (StatSample& stat : item.second) {
+			success = success && writer->append(stat);
+		}
+
+		if (!success || !writer->flush()) {
+			printf("Stat write failed. Retrying next update: %s\n", item.first.c_str());
+
+			// Starting a new block flushes the previous one, so some of the stats may be saved already.
+			// The rest are left out of the file and written again.
+			vector<StatSample>& stats = item.second;
+			if (writer) {
+				size_t saved = writer->savedStats() - savedBefore;
+				stats.erase(stats.begin(), stats.begin() + saved);
+				writer->discard();
+			}
+			closeCachedStatFile(state.getStatFilePath());
+			failedStats[item.first].swap(stats);
+
+			// the live/avg files are regenerated once the history is written
+			g_pendingWrites.erase(state.getLiveStatFilePath());
+			g_pendingWrites.erase(state.getLiveAvgStatFilePath());
+			g_pendingLiveRebuilds.erase(state.addr);
+			g_pendingLiveTrims.erase(state.addr);
+			state.liveFilesValid = false;
+		}
+
+		if (writer) {
+			g_writeStats.filesFlushed++;
+		}
+	}
+	g_pendingStats.clear();
+
+	flushPendingWrites();
+
+	for (auto& item : g_pendingLiveRebuilds) {
+		auto serv = g_servers.find(item.first);
+		if (serv != g_servers.end()) {
+			closeCachedStatFile(serv->second.getLiveStatFilePath());
+			closeCachedStatFile(serv->second.getLiveAvgStatFilePath());
+			writeLiveStatFiles(serv->second, item.second);
+		}
+		g_pendingLiveTrims.erase(item.first);
+	}
+	g_pendingLiveRebuilds.clear();
+
+	for (auto& item : failedStats) {
+		if (item.second.size()) {
+			g_pendingLiveRebuilds[item.first] = item.second.back().time;
+		}
+	}
+	g_pendingStats.swap(failedStats);
+
+	for (auto& item : g_pendingLiveTrims) {
+		auto serv = g_servers.find(item.first);
+		if (serv != g_servers.end() && serv->second.liveFilesValid) {
+			closeCachedStatFile(serv->second.getLiveStatFilePath());
+			trimLiveStatFile(serv->second, item.second);
+		}
+	}
+	g_pendingLiveTrims.clear();
+
+	g_writeStats.flushMicros += getEpochMicros() - startTime;
+}
+
 bool createServerStatFile(ServerState& newState) {
 	string dispName = newState.displayName();
 	printf("New server: %s\n", dispName.c_str());
@@ -873,7 +1222,7 @@ bool createServerStatFile(ServerState& newState) {
 		return false;
 	}
 
-	writeStatHeader(file, statFileMagicBytes, fpath);
+	writeStatHeader(file, statFileMagicBytes, fpath, STAT_HISTORY_VERSION);
 
 	g_writeStats.bytesWritten += sizeof(StatFileHeader);
 	newState.players = 255; // force a stat write
@@ -883,7 +1232,6 @@ bool createServerStatFile(ServerState& newState) {
 }
 
 bool writeServerStat(ServerState& state, int newPlayerCount, bool unreachable, uint32_t now) {
-	uint32_t writeTimeDelta = now - state.lastWriteTime;
 	string dispName = state.displayName();
 
 	if (state.lastWriteTime > now) {
@@ -894,73 +1242,114 @@ bool writeServerStat(ServerState& state, int newPlayerCount, bool unreachable, u
 		return true; // no delta to write
 	}
 
-	string fpath = state.getStatFilePath();
-	FILE* file = fopen(fpath.c_str(), "ab");
-	if (!file) {
-		printf("Failed to reopen stat file: %s\n", fpath.c_str());
-		return false;
-	}
-
 	if (!unreachable && state.unreachable) {
 		uint32_t unresponsiveDelta = now - state.lastResponseTime;
 		printf("Server is responding again (%.1f minutes): %s\n", unresponsiveDelta / 60.0f, dispName.c_str());
 	}
-	else if (state.players != 255 && !unreachable) {
-		//printf("%d -> %d after %us: %s\n", state.players, newPlayerCount, writeTimeDelta, dispName.c_str());
-	}
 
 	state.players = unreachable ? 0 : newPlayerCount;
 
-	uint8_t stat = state.players;
-	uint8_t timeFlag = 0;
+	StatSample stat;
+	stat.time = now;
+	stat.players = state.players;
+	stat.unreachable = unreachable;
 
-	if (writeTimeDelta > 65535) {
-		timeFlag = FL_PCNT_TIME32;
-	}
-	else if (writeTimeDelta > 255) {
-		timeFlag = FL_PCNT_TIME16;
-	}
-	
-	if (unreachable) {
-		// player count unknown, so use the unused bits for more flags
-		stat = PCNT_UNREACHABLE | (timeFlag >> 2);
+	// live/avg files use the v1 format
+	uint8_t statBytes[5];
+	int statLen = encodeStat(state.lastWriteTime, stat, statBytes);
+
+	g_writeStats.bytesWritten += statLen;
+
+	state.lastWriteTime = now;
+	state.unreachable = unreachable;
+	state.rankWindow.add(now, stat.players);
+	state.rankHours.add(now, stat.players, unreachable);
+
+	if (g_statWalMode) {
+		// live/avg files are updated when the WAL is compacted
+		wal_queue_stat(state.addr, stat);
 	}
 	else {
-		stat |= timeFlag;
-	}
-	fwrite(&stat, sizeof(uint8_t), 1, file);
-	
-	if (writeTimeDelta > 65535) {
-		g_writeStats.bytesWritten += 1 + 4;
-		if (!fwrite(&now, sizeof(uint32_t), 1, file)) {
-			printf("Stat write failed\n");
-			return false;
+		g_pendingStats[state.addr].push_back(stat);
+
+		if (state.liveFilesValid) {
+			queueLiveStats(state, statBytes, statLen, now);
 		}
-	}
-	else if (writeTimeDelta > 255) {
-		g_writeStats.bytesWritten += 1 + 2;
-		if (!fwrite(&writeTimeDelta, sizeof(uint16_t), 1, file)) {
-			printf("Stat write failed\n");
-			return false;
+		else {
+			g_pendingLiveRebuilds[state.addr] = now; // history must be flushed first
 		}
 	}
+
+	g_writeStats.serversUpdated++;
+	return true;
+}
+
+// Round trip time files have a stat for each RTT_STAT_FREQ seconds in which the server responded:
+//   varint seconds since the previous stat (0 = a 32-bit absolute time follows)
+//   varint lowest round trip time (0.1 ms)
+//   varint median round trip time minus the lowest
+// The median is the median of the A2S passes' medians.
+int encodeRttStat(uint32_t prevTime, uint32_t time, uint16_t minRtt, uint16_t medianRtt, uint8_t* out) {
+	int len = 0;
+
+	if (prevTime && time > prevTime) {
+		len += writeVarint(time - prevTime, out);
+	}
 	else {
-		g_writeStats.bytesWritten += 1 + 1;
-		if (!fwrite(&writeTimeDelta, sizeof(uint8_t), 1, file)) {
-			printf("Stat write failed\n");
-			return false;
-		}
+		// the previous stat is unknown after a restart
+		len += writeVarint(0, out);
+		memcpy(out + len, &time, sizeof(uint32_t));
+		len += sizeof(uint32_t);
 	}
 
-	fclose(file);
+	len += writeVarint(minRtt, out + len);
+	len += writeVarint(medianRtt > minRtt ? medianRtt - minRtt : 0, out + len);
+	return len;
+}
 
-	state.lastWriteTime = now;
-	state.unreachable = unreachable;
+// adds the round trip times from the last A2S pass, and queues a stat for servers whose stat interval ended
+void updateRttStats(uint32_t now) {
+	for (auto& item : g_servers) {
+		ServerState& state = item.second;
 
-	writeLiveStatFiles(state, now);
+		if (state.a2s_rttMin) {
+			uint16_t minRtt = std::min(state.a2s_rttMin / 100, 65535u);
+			uint16_t medianRtt = std::min(state.a2s_rttMedian / 100, 65535u);
 
-	g_writeStats.serversUpdated++;
-	return true;
+			if (!state.numRttMedians) {
+				state.rttStatStart = now;
+				state.rttMin = minRtt;
+			}
+
+			state.rttMin = std::min(state.rttMin, minRtt);
+			if (state.numRttMedians < RTT_MAX_PASSES) {
+				state.rttMedians[state.numRttMedians++] = medianRtt;
+			}
+		}
+
+		if (!state.numRttMedians || now - state.rttStatStart < RTT_STAT_FREQ) {
+			continue;
+		}
+
+		string fpath = state.getRttStatFilePath();
+		if (!state.lastRttWrite && !fileExists(fpath)) {
+			StatFileHeader header;
+			header.version = RTT_FILE_VERSION;
+			memcpy(header.magic, rttFileMagicBytes, 4);
+			queueStatWrite(state, fpath, (uint8_t*)&header, sizeof(StatFileHeader));
+		}
+
+		uint16_t* medians = state.rttMedians;
+		int mid = state.numRttMedians / 2;
+		nth_element(medians, medians + mid, medians + state.numRttMedians);
+
+		uint8_t stat[16];
+		int statLen = encodeRttStat(state.lastRttWrite, now, state.rttMin, medians[mid], stat);
+		queueStatWrite(state, fpath, stat, statLen);
+
+		state.lastRttWrite = now;
+		state.numRttMedians = 0;
+	}
 }
 
 bool archiveFile(string src, string dst) {
@@ -989,10 +1378,22 @@ bool archiveStats(string serverId) {
 	}
 	ServerState& state = g_servers[serverId];
 
+	closeCachedStatFile(state.getStatFilePath());
+	closeCachedStatFile(state.getLiveStatFilePath());
+	closeCachedStatFile(state.getLiveAvgStatFilePath());
+	closeCachedStatFile(state.getRttStatFilePath());
+	wal_forget_server(serverId);
+
 	if (!archiveFile(state.getStatFilePath(), state.getStatArchiveFilePath())) {
 		return false;
 	}
-	archiveFile(state.getRankHistFilePath(), state.getRankArchiveFilePath());
+	if (fileExists(state.getRankHistFilePath())) {
+		// rank files from older versions, which were imported into the rank store
+		archiveFile(state.getRankHistFilePath(), state.getRankArchiveFilePath());
+	}
+	if (fileExists(state.getRttStatFilePath())) {
+		archiveFile(state.getRttStatFilePath(), state.getRttArchiveFilePath());
+	}
 
 	// these files can be re-generated later
 	string livePath = state.getLiveStatFilePath();
@@ -1005,20 +1406,59 @@ bool archiveStats(string serverId) {
 	return true;
 }
 
-void updateStats(Document& doc, Value& serverList, uint32_t now) {
+// states of the servers in the server list
+void parseServerList(Value& serverList, vector<ServerState>& responses) {
 	int numServers = serverList.GetArray().Size();
-
-	set<string> updatedServers;
-
-	g_writeStats.bytesWritten = 0;
-	g_writeStats.serversUpdated = 0;
+	responses.reserve(numServers);
 
 	for (int i = 0; i < numServers; i++) {
 		ServerState newState;
-		if (!parseSteamServerJson(serverList[i], newState)) {
+		if (parseSteamServerJson(serverList[i], newState)) {
+			responses.push_back(newState);
+		}
+	}
+}
+
+// states of the servers that responded to A2S_INFO in the last A2S pass
+void getA2SResponses(vector<ServerState>& responses) {
+	for (auto& item : g_servers) {
+		ServerState& state = item.second;
+		if (!state.a2s_info_success) {
 			continue;
 		}
 
+		ServerState newState;
+		newState.init();
+		newState.addr = item.first;
+		newState.name = state.a2s_info.name;
+		newState.map = state.a2s_info.map;
+		newState.players = state.a2s_info.players;
+		newState.maxPlayers = state.a2s_info.maxPlayers;
+		newState.bots = state.a2s_info.bots;
+		newState.flags = 0;
+		if (state.a2s_info.serverType == 'd') {
+			newState.flags |= FL_SERVER_DEDICATED;
+		}
+		if (state.a2s_info.vac) {
+			newState.flags |= FL_SERVER_SECURE;
+		}
+		if (state.a2s_info.environment == 'l') {
+			newState.flags |= FL_SERVER_LINUX;
+		}
+		responses.push_back(newState);
+	}
+}
+
+// writes stats for the servers that responded, and marks the others as unreachable or dead
+void updateStats(vector<ServerState>& responses, uint32_t now) {
+	set<string> updatedServers;
+
+	g_writeStats.bytesWritten = 0;
+	g_writeStats.serversUpdated = 0;
+	g_writeStats.filesFlushed = 0;
+	g_writeStats.flushMicros = 0;
+
+	for (ServerState& newState : responses) {
 		string id = newState.addr;
 		updatedServers.insert(newState.addr);
 
@@ -1059,6 +1499,12 @@ void updateStats(Document& doc, Value& serverList, uint32_t now) {
 		}
 	}
 
+	flushStatWrites();
+
+	if (g_statWalMode && delKeys.size()) {
+		wal_compact(); // stats must be in the stat files before they're archived
+	}
+
 	for (string key : delKeys) {
 		if (archiveStats(key)) {
 			g_servers.erase(key);
@@ -1089,232 +1535,62 @@ bool validateStatName(string name) {
 	return true;
 }
 
-bool compareByRank(const ServerState& a, const ServerState& b)
-{
-	return a.rankSum > b.rankSum;
-}
-
-bool loadRankHistory(ServerState& state, uint16_t& lastRank, uint32_t& lastRankWriteTime, uint32_t now) {
-	FILE* file = loadRankFile(state);
-
-	if (!file) {
-		return false;
-	}
-
-	lastRank = 0;
-	lastRankWriteTime = 0;
-
-	while (1) {
-		uint8_t rankChange;
-		if (!fread(&rankChange, sizeof(uint8_t), 1, file)) {
-			break;
-		}
-		uint8_t flags = rankChange & FL_RANK_MASK;
-		uint8_t rankDelta = rankChange & ~FL_RANK_MASK;
-
-		if (flags & FL_RANK_RANK16) {
-			if (rankDelta) {
-				printf("Invalid rank bits in 16bit delta\n");
-				fclose(file);
-				return false;
-			}
-			if (!fread(&lastRank, sizeof(uint16_t), 1, file)) {
-				printf("Failed to read rank\n");
-				fclose(file);
-				return false;
-			}
-		}
-		else {
-			int8_t rankSigned = rankDelta;
-			if (rankDelta & RANK_SIGN_BIT) {
-				rankSigned |= FL_RANK_MASK; // sign extension to fit the int8
-			}
-			int newRank = (int)lastRank + (int)rankSigned;
-			if (newRank < 0 || newRank > 65535) {
-				printf("Invalid new rank: %d\n", newRank);
-				fclose(file);
-				return false;
-			}
-			lastRank = newRank;
-		}
-
-		if (flags & FL_RANK_TIME32) {
-			if (!fread(&lastRankWriteTime, sizeof(uint32_t), 1, file)) {
-				printf("Failed to read rank time\n");
-				fclose(file);
-				return false;
-			}
-		}
-		else {
-			uint16_t delta;
-			if (!fread(&delta, sizeof(uint16_t), 1, file)) {
-				printf("Failed to read rank time delta\n");
-				fclose(file);
-				return false;
-			}
-			lastRankWriteTime += delta;
-		}
-	}
-
-	fclose(file);
-
-	if (lastRankWriteTime > now) {
-		printf("Invalid rank time parsed: %u\n", lastRankWriteTime);
-		return false;
+// rank windows are updated as stats are written, so this only slides them to the current time
+void updateRankSums(uint32_t now) {
+	for (auto& item : g_servers) {
+		item.second.updateRankSums(now);
 	}
-
-	return true;
 }
 
-bool writeRankFile(ServerState& state, uint16_t rank, uint32_t now) {
-	string fpath = state.getRankHistFilePath();
-
-	FILE* file = NULL;
-	uint16_t lastRank = 0;
-	uint32_t lastRankWriteTime = 0;
-
-	bool createdNewFile = false;
-
-	if (!fileExists(fpath)) {
-		errno = 0;
-		file = fopen(fpath.c_str(), "wb");
-		if (!file) {
-			printf("Failed to create rank file (error %d): %s\n", errno, fpath.c_str());
-			return false;
-		}
-		if (!writeStatHeader(file, rankFileMagicBytes, fpath)) {
-			printf("Failed to write rank file header: %s\n", fpath.c_str());
-			fclose(file);
-			return false;
-		}
-		createdNewFile = true;
-	}
-	else {
-		if (!loadRankHistory(state, lastRank, lastRankWriteTime, now)) {
-			printf("Failed to load rank history: %s\n", fpath.c_str());
-			return false;
-		}
-
-		file = fopen(fpath.c_str(), "ab");
-		if (!file) {
-			printf("Failed to append rank file: %s\n", fpath.c_str());
-			return false;
-		}
-	}
-
-	if (rank == lastRank && !createdNewFile) {
-		fclose(file);
-		return true; // no delta to write
-	}
-
-	uint8_t rankByte = 0;
-	int rankDelta = (int)rank - (int)lastRank;
-
-	if (rankDelta > 31 || rankDelta < -32 || createdNewFile) {
-		rankByte |= FL_RANK_RANK16;
-	}
-	else {
-		rankByte = rankDelta & ~FL_RANK_MASK;
-	}
-
-	if (now - lastRankWriteTime > 65535 || createdNewFile) {
-		rankByte |= FL_RANK_TIME32;
-	}
-
-	if (!fwriteVerbose(&rankByte, sizeof(uint8_t), file, "rank delta")) {
-		fclose(file);
+// ranks servers and starts writing rank files in the background.
+// Returns false if the previous rank pass hasn't finished.
+bool computeRanks(uint32_t now) {
+	if (rank_running()) {
 		return false;
 	}
 
-	if (rankByte & FL_RANK_RANK16) {
-		if (!fwriteVerbose(&rank, sizeof(uint16_t), file, "rank bytes")) {
-			fclose(file);
-			return false;
-		}
-	}
-	if (rankByte & FL_RANK_TIME32) {
-		if (!fwriteVerbose(&now, sizeof(uint32_t), file, "rank time")) {
-			fclose(file);
-			return false;
-		}
-	}
-	else {
-		uint16_t delta = now - lastRankWriteTime;
-		if (!fwriteVerbose(&delta, sizeof(uint16_t), file, "rank time")) {
-			fclose(file);
-			return false;
-		}
-	}
-
-	fclose(file);
-
-	return true;
-}
-
-void computeRanks() {
-	vector<string> statFiles = getDirFiles(statsPath, "dat", "");
+	updateRankSums(now);
 
-	uint32_t now = getEpochSeconds();
+	vector<ServerState*> rankedServers;
+	vector<ServerRank> ranks(g_servers.size());
 
-	vector<ServerState> rankedServers;
-
-	for (auto item : g_servers) {
-		item.second.rankSum = 0;
+	for (auto& item : g_servers) {
+		ranks[rankedServers.size()].serverId = item.second.addr;
+		rankedServers.push_back(&item.second);
 	}
 
-	for (string path : statFiles) {
-		string fname = path.substr(0, path.find_last_of("."));
-		if (!validateStatName(fname)) {
-			printf("Invalid stat file name: %s", fname.c_str());
-			continue;
-		}
-		if (g_servers.find(fname) == g_servers.end()) {
-			printf("Skip ranking untracked server: %s\n", fname.c_str());
-			continue;
+	// every window is scored from the same rank sums and hourly rollups, so the order of the servers
+	// is only sorted out here
+	vector<int> order(rankedServers.size());
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		for (size_t i = 0; i < order.size(); i++) {
+			ServerState& serv = *rankedServers[i];
+			serv.rankScores[w] = g_rankFormula->score(serv, w, now);
+			order[i] = i;
 		}
 
-		ServerState state = ServerState();
-		state.init();
-		state.addr = fname;
-		state.name = g_servers[state.addr].name;
+		std::sort(order.begin(), order.end(), [&](int a, int b) {
+			return rankedServers[a]->rankScores[w] > rankedServers[b]->rankScores[w];
+		});
 
-		if (!loadServerHistory(state, now, false)) {
-			g_servers.erase(fname);
-			printf("File corruption: %s\n", fname.c_str());
-			continue;
+		for (size_t i = 0; i < order.size(); i++) {
+			// zero means the server scored nothing, such as when no players joined during the window
+			ranks[order[i]].ranks[w] = rankedServers[order[i]]->rankScores[w] > 0 ? i+1 : 0;
 		}
 
-		g_servers[state.addr].rankSum = state.rankSum;
-
-		rankedServers.push_back(state);
-	}
-
-	std::sort(rankedServers.begin(), rankedServers.end(), compareByRank);
-
-	int totalUpdates = 0;
-	printf("Server ranks:\n");
-	for (int i = 0; i < rankedServers.size(); i++) {
-		ServerState& serv = rankedServers[i];
-
-		// zero means no players ever joined during the ranking period
-		uint16_t writeRank = serv.rankSum ? i+1 : 0;
-		int& lastRank = g_servers[serv.addr].lastRank;
-		
-		if (lastRank == -1 || writeRank != lastRank) {
-			writeRankFile(serv, writeRank, now);
-			totalUpdates++;
+		if (w != RANK_WINDOW_DEFAULT) {
+			continue;
 		}
 
-		lastRank = writeRank;
-
-		if (i < 10) {
+		printf("Server ranks (%s):\n", g_rankFormula->desc);
+		for (size_t i = 0; i < order.size() && i < 10; i++) {
+			ServerState& serv = *rankedServers[order[i]];
 			string dispName = serv.displayName();
-			float avg = serv.rankSum / (float)TOTAL_RANK_DATA_POINTS;
-			printf("%2d) %.2f = %s\n", i+1, avg, dispName.c_str());
+			printf("%2d) %.2f = %s\n", (int)i+1, serv.rankScores[w], dispName.c_str());
 		}
 	}
 
-	printf("Updated %d/%d rank files\n", totalUpdates, (int)rankedServers.size());
+	return rank_start(now, ranks);
 }
 
 void cleanupServerListJson(Document& doc, Value& serverList) {
@@ -1348,6 +1624,20 @@ void cleanupServerListJson(Document& doc, Value& serverList) {
 	}
 }
 
+// Fetches the server list until it succeeds, and sets how long that took. Runs alongside the A2S pass,
+// which only queries servers that were already known.
+void serverListThread(Document& json, uint64_t& fetchMillis) {
+	uint64_t fetchStartTime = getEpochMillis();
+	Value& serverList = json;
+
+	while (!getServerListJson(serverList, json)) {
+		this_thread::sleep_for(seconds(10));
+	}
+
+	cleanupServerListJson(json, serverList);
+	fetchMillis = getEpochMillis() - fetchStartTime;
+}
+
 void saveServerInfos() {
 	Document infoDoc;
 	infoDoc.SetObject();
@@ -1378,16 +1668,30 @@ void saveServerInfos() {
 		obj.AddMember("players", server.players, allocator);
 		obj.AddMember("bots", server.bots, allocator);
 		obj.AddMember("map", map, allocator);		
-		obj.AddMember("rank", server.rankSum, allocator);		
+		obj.AddMember("rank", server.rankSums[RANK_WINDOW_DEFAULT], allocator);
+		for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+			Value rankKey(("rank_" + string(g_rankWindows[w].name)).c_str(), allocator);
+			obj.AddMember(rankKey, server.rankSums[w], allocator);
+		}
+		obj.AddMember("score", server.rankScores[RANK_WINDOW_DEFAULT], allocator);
 		obj.AddMember("country", country, allocator);
 		obj.AddMember("region", region, allocator);
+
+		if (server.a2s_rttMin) {
+			// milliseconds, rounded to 0.1
+			obj.AddMember("rtt_min", (int)((server.a2s_rttMin + 50) / 100) / 10.0, allocator);
+			obj.AddMember("rtt_median", (int)((server.a2s_rttMedian + 50) / 100) / 10.0, allocator);
+		}
 		
 		if (server.a2s_success) {
 			Value playerList;
 			playerList.SetArray();
 
-			for (Player& plr : server.a2s_players) {
-				string a2sStr = plr.name + "\\" + to_string(plr.score) + "\\" + to_string((int)plr.duration);
+			PlayerList& list = g_a2sPlayers[server.a2s_playerList];
+
+			for (int i = 0; i < server.a2s_numPlayers; i++) {
+				Player& plr = list.players[server.a2s_firstPlayer + i];
+				string a2sStr = list.getName(plr) + "\\" + to_string(plr.score) + "\\" + to_string((int)plr.duration);
 				Value a2sVal(a2sStr.c_str(), allocator);
 
 				playerList.PushBack(a2sVal, allocator);
@@ -1403,7 +1707,15 @@ void saveServerInfos() {
 	infoDoc.AddMember("deadTime", SERVER_DEAD_SECONDS, allocator);
 	infoDoc.AddMember("unreachableTime", SERVER_UNREACHABLE_TIME, allocator);
 	infoDoc.AddMember("rankFreq", RANK_FREQ, allocator);
-	infoDoc.AddMember("rankStatMaxAge", RANK_STAT_MAX_AGE, allocator);
+	infoDoc.AddMember("rankStatMaxAge", g_rankWindows[RANK_WINDOW_DEFAULT].length, allocator);
+
+	Value rankWindows(kObjectType);
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		Value windowName(g_rankWindows[w].name, allocator);
+		rankWindows.AddMember(windowName, g_rankWindows[w].length, allocator);
+	}
+	infoDoc.AddMember("rankWindows", rankWindows, allocator);
+	infoDoc.AddMember("rankFormula", Value(g_rankFormula->name, allocator), allocator);
 	infoDoc.AddMember("rankStatInterval", RANK_STAT_INTERVAL, allocator);
 	infoDoc.AddMember("lastRankTime", g_lastRankTime, allocator);
 	infoDoc.AddMember("lastUpdateTime", g_lastUpdateTime, allocator);
@@ -1460,6 +1772,8 @@ bool loadServerInfos() {
 			remove(state.getStatArchiveFilePath().c_str());
 			remove(state.getRankHistFilePath().c_str());
 			remove(state.getStatFilePath().c_str());
+			remove(state.getRttStatFilePath().c_str());
+			remove(state.getRttArchiveFilePath().c_str());
 			g_servers.erase(fname);
 			continue;
 		}
@@ -1471,15 +1785,391 @@ bool loadServerInfos() {
 		}
 	}
 
+	flushStatWrites();
+
+	return true;
+}
+
+// converts all active and archived stat files to the latest version.
+// Active files are also upgraded the first time they're written to.
+bool upgradeStatFiles() {
+	int numUpgraded = 0;
+	int numFailed = 0;
+	string dirs[2] = { statsPath, archivePath };
+
+	for (string& dir : dirs) {
+		vector<string> statFiles = getDirFiles(dir, "dat", "");
+
+		for (string fname : statFiles) {
+			bool upgraded = false;
+			if (!upgradeStatFile(dir + fname, upgraded)) {
+				numFailed++;
+				continue;
+			}
+
+			if (upgraded) {
+				numUpgraded++;
+			}
+		}
+	}
+
+	printf("Upgraded %d stat files to v%d (%d failed)\n", numUpgraded, STAT_HISTORY_VERSION, numFailed);
+	return numFailed == 0;
+}
+
+bool useTestDataPath(const string& path) {
+	dataStatsPath = path;
+	statsPath = path + "active/";
+	liveDataPath = path + "live/";
+	avgDataPath = path + "avg/";
+	archivePath = path + "archive/";
+	rttDataPath = path + "rtt/";
+	archiveRttPath = path + "archive/rtt/";
+
+	string dirs[] = { dataStatsPath, statsPath, liveDataPath, avgDataPath, archivePath, rttDataPath, archiveRttPath };
+	for (string& dir : dirs) {
+		if (!dirExists(dir) && !createDir(dir)) {
+			printf("Failed to create folder: %s\n", dir.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+vector<uint8_t> readTestFile(const string& path) {
+	MappedFile file;
+	if (!file.open(path)) {
+		return vector<uint8_t>();
+	}
+	return vector<uint8_t>(file.data, file.data + file.size);
+}
+
+vector<StatSample> readTestStats(ServerState& state) {
+	vector<StatSample> stats;
+	MappedFile file;
+	uint32_t version = 0;
+
+	if (loadStatFile(state, file, version)) {
+		StatCursor cursor = file.cursor(sizeof(StatFileHeader));
+		decodeStatHistory(cursor, version, [&](const StatRecord& rec) {
+			stats.push_back(rec);
+			return true;
+		});
+	}
+
+	return stats;
+}
+
+// checks that the unreachable stat written for a server that was down while the program was stopped
+// survives the restart. Its time is the same as the last stat in the file. Returns 0 if it passed.
+int stat_write_test() {
+	if (!useTestDataPath("stattest/")) {
+		return 1;
+	}
+
+	string addr = "10.0.0.2_27015";
+	ServerState& state = g_servers[addr];
+	state.init();
+	state.addr = addr;
+	remove(state.getStatFilePath().c_str());
+	remove(state.getLiveStatFilePath().c_str());
+	remove(state.getLiveAvgStatFilePath().c_str());
+	if (!createServerStatFile(state)) {
+		return 1;
+	}
+
+	uint32_t startTime = getEpochSeconds() - 60 * 60;
+	uint32_t stopTime = startTime + 600;
+	writeServerStat(state, 5, false, startTime);
+	flushStatWrites();
+	writeServerStat(state, 7, false, stopTime);
+	flushStatWrites();
+
+	// the program stops, and the server stops responding before it starts again
+	for (int restart = 0; restart < 2; restart++) {
+		closeCachedStatFile(state.getStatFilePath());
+		closeCachedStatFile(state.getLiveStatFilePath());
+		closeCachedStatFile(state.getLiveAvgStatFilePath());
+
+		state.init();
+		state.addr = addr;
+		state.lastResponseTime = stopTime;
+		if (!loadServerHistory(state, getEpochSeconds(), true)) {
+			printf("FAIL: stat history could not be loaded after a restart\n");
+			return 1;
+		}
+		flushStatWrites();
+	}
+
+	closeCachedStatFile(state.getStatFilePath());
+	closeCachedStatFile(state.getLiveStatFilePath());
+	closeCachedStatFile(state.getLiveAvgStatFilePath());
+	bool reloadedUnreachable = state.unreachable;
+	vector<StatSample> stats = readTestStats(state);
+	g_servers.erase(addr);
+
+	bool unreachableSaved = stats.size() == 3 && stats[2].time == stopTime && stats[2].unreachable;
+	if (!unreachableSaved || !reloadedUnreachable) {
+		printf("FAIL: the unreachable stat from the restart was lost (%d stats in the file, server %s after reloading)\n",
+			(int)stats.size(), reloadedUnreachable ? "unreachable" : "reachable");
+		return 1;
+	}
+
+	printf("PASS: the unreachable stat written after a restart is in the stat file\n");
+	return 0;
+}
+
+// averaged stats the way they were written before samples were summed in closed form,
+// by pushing a sample for every minute
+struct MinuteLoopAvg {
+	uint32_t lastAvgStatTime = 0;
+	uint32_t lastAvgStatWrite = 0;
+	uint8_t lastAvgPlayerCount = 0;
+	deque<uint8_t> avgHistory;
+
+	void append(uint32_t statTime, uint8_t playerCount, vector<uint8_t>& avgData) {
+		uint32_t numStatsPerAvg = AVG_STAT_FILE_INTERVAL / STAT_WRITE_FREQ;
+
+		if (lastAvgStatTime == 0) {
+			lastAvgStatTime = statTime;
+		}
+		while (statTime > lastAvgStatTime) { // back-fill gaps
+			avgHistory.push_back(lastAvgPlayerCount);
+			if (avgHistory.size() > numStatsPerAvg) {
+				avgHistory.pop_front();
+			}
+			lastAvgStatTime += RANK_STAT_INTERVAL;
+		}
+
+		uint32_t avgDelta = statTime - lastAvgStatWrite;
+		if (avgDelta >= AVG_STAT_FILE_INTERVAL && avgHistory.size() == numStatsPerAvg) {
+			float total = 0;
+			for (uint8_t count : avgHistory) {
+				total += count;
+			}
+			total /= (float)avgHistory.size();
+
+			avgData.push_back(getDeltaFlags(avgDelta) | (uint8_t)(total + 0.5f));
+			writeDelta(lastAvgStatWrite, statTime, avgData);
+			lastAvgStatWrite = statTime;
+		}
+
+		lastAvgPlayerCount = playerCount < STAT_V1_MAX_PLAYERS ? playerCount : STAT_V1_MAX_PLAYERS;
+	}
+};
+
+// checks that averaged stats summed from the sample grid are the same as the ones written by
+// the minute-by-minute loop, both when the live files are rebuilt and as stats are added. Returns 0 if it passed.
+int avg_stat_test() {
+	if (!useTestDataPath("avgtest/")) {
+		return 1;
+	}
+
+	ServerState state;
+	state.init();
+	state.addr = "10.0.0.3_27015";
+	remove(state.getStatFilePath().c_str());
+	remove(state.getLiveStatFilePath().c_str());
+	remove(state.getLiveAvgStatFilePath().c_str());
+	if (!createServerStatFile(state)) {
+		return 1;
+	}
+
+	// Stats are about a minute apart, often exactly on a sample time, with gaps of up to 7 hours.
+	// Player counts jump around so that a sample taken from the wrong stat changes the average,
+	// and some are above the v1 limit.
+	uint32_t now = getEpochSeconds();
+	uint32_t sampleTime = now - 60 * 60 * 24 * 5; // samples are taken every minute from the first stat
+	uint32_t seed = 12345;
+	vector<StatSample> stats;
+
+	while (sampleTime < now) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+
+		StatSample stat;
+		stat.time = sampleTime + (stats.empty() || r % 2 ? 0 : r % 31);
+		stat.unreachable = r % 50 == 0;
+		stat.players = stat.unreachable || r % 3 == 0 ? 0 : 40 + r % 30;
+		stats.push_back(stat);
+
+		sampleTime += r % 400 == 0 ? 60 * 60 * 7 : r % 20 == 0 ? 60 * (5 + r % 90) : 60;
+	}
+
+	// the first 3 days are in the history file when the live files are rebuilt
+	size_t numSaved = 0;
+	while (numSaved < stats.size() && stats[numSaved].time < now - 60 * 60 * 24 * 2) {
+		numSaved++;
+	}
+
+	StatBlockWriter writer;
+	bool written = openStatWriter(state, writer);
+	for (size_t i = 0; i < numSaved; i++) {
+		written = written && writer.append(stats[i]);
+	}
+	written = written && writer.flush();
+	writer.close();
+
+	if (!written || !writeLiveStatFiles(state, stats[numSaved - 1].time)) {
+		printf("Failed to write test stat history\n");
+		return 1;
+	}
+
+	MinuteLoopAvg minuteLoop;
+	vector<uint8_t> expectedAvg;
+	for (size_t i = 0; i < numSaved; i++) {
+		minuteLoop.append(stats[i].time, stats[i].players, expectedAvg);
+	}
+
+	vector<uint8_t> avgFile = readTestFile(state.getLiveAvgStatFilePath());
+	vector<uint8_t> rebuiltAvg;
+	if (avgFile.size() >= sizeof(StatFileHeader)) {
+		rebuiltAvg.assign(avgFile.begin() + sizeof(StatFileHeader), avgFile.end());
+	}
+
+	int failures = 0;
+
+	if (expectedAvg.empty() || rebuiltAvg != expectedAvg) {
+		printf("FAIL: rebuilt avg file differs from the minute loop (%d vs %d bytes)\n",
+			(int)rebuiltAvg.size(), (int)expectedAvg.size());
+		failures++;
+	}
+	else {
+		printf("PASS: rebuilt avg file matches the minute loop (%d bytes)\n", (int)rebuiltAvg.size());
+	}
+
+	// the rest of the stats are added as the server is polled
+	vector<uint8_t> appendedAvg;
+	expectedAvg.clear();
+	for (size_t i = numSaved; i < stats.size(); i++) {
+		appendAvgStat(state, stats[i].time, stats[i].players, appendedAvg);
+		minuteLoop.append(stats[i].time, stats[i].players, expectedAvg);
+	}
+
+	if (expectedAvg.empty() || appendedAvg != expectedAvg) {
+		printf("FAIL: appended avg stats differ from the minute loop (%d vs %d bytes)\n",
+			(int)appendedAvg.size(), (int)expectedAvg.size());
+		failures++;
+	}
+	else {
+		printf("PASS: appended avg stats match the minute loop (%d bytes)\n", (int)appendedAvg.size());
+	}
+
+	return failures ? 1 : 0;
+}
+
+// prints the ranks of all servers at the given time
+bool printRanks(uint32_t time) {
+	vector<ServerRank> ranks;
+	uint32_t epochTime;
+
+	if (!rank_load(time, ranks, epochTime)) {
+		return false;
+	}
+
+	std::sort(ranks.begin(), ranks.end(), [](const ServerRank& a, const ServerRank& b) {
+		return a.ranks[RANK_WINDOW_DEFAULT] < b.ranks[RANK_WINDOW_DEFAULT];
+	});
+
+	printf("Ranks written at %u:\n", epochTime);
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		printf("%5s ", g_rankWindows[w].name);
+	}
+	printf("server\n");
+
+	for (ServerRank& rank : ranks) {
+		for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+			if (rank.ranks[w] == RANK_UNTRACKED) {
+				printf("%5s ", "-");
+			}
+			else {
+				printf("%5d ", (int)rank.ranks[w]);
+			}
+		}
+		printf("%s\n", rank.serverId.c_str());
+	}
+
 	return true;
 }
 
 int main(int argc, char** argv) {
 	if (argc <= 1) {
-		printf("Usage: sventracker <app_id>\n");
+		printf("Usage: sventracker <app_id> [--wal] [--direct] [--rank-formula name]\n");
+		printf("       sventracker --bench-decode [servers] [years]\n");
+		printf("       sventracker --upgrade-stats\n");
+		printf("       sventracker --test-wal\n");
+		printf("       sventracker --test-stat-writes\n");
+		printf("       sventracker --test-ranks\n");
+		printf("       sventracker --test-avg-stats\n");
+		printf("       sventracker --test-statsum\n");
+		printf("       sventracker --test-a2s\n");
+		printf("       sventracker --ranks-at [epoch_seconds]\n");
+		printf("\nRank formulas:\n");
+		for (int i = 0; i < g_numRankFormulas; i++) {
+			printf("  %-10s %s\n", g_rankFormulas[i].name, g_rankFormulas[i].desc);
+		}
 		return 0;
 	}
 
+	if (!strcmp(argv[1], "--bench-decode")) {
+		int numServers = argc > 2 ? atoi(argv[2]) : 100;
+		int years = argc > 3 ? atoi(argv[3]) : 3;
+		return bench_decode(numServers, years);
+	}
+
+	if (!strcmp(argv[1], "--test-wal")) {
+		return wal_test();
+	}
+
+	if (!strcmp(argv[1], "--test-stat-writes")) {
+		return stat_write_test();
+	}
+
+	if (!strcmp(argv[1], "--test-ranks")) {
+		return rank_test();
+	}
+
+	if (!strcmp(argv[1], "--test-avg-stats")) {
+		return avg_stat_test();
+	}
+
+	if (!strcmp(argv[1], "--test-statsum")) {
+		return statsum_test();
+	}
+
+	if (!strcmp(argv[1], "--test-a2s")) {
+		return a2s_test();
+	}
+
+	if (!strcmp(argv[1], "--upgrade-stats")) {
+		return upgradeStatFiles() ? 0 : 1;
+	}
+
+	if (!strcmp(argv[1], "--ranks-at")) {
+		uint32_t time = argc > 2 ? strtoul(argv[2], NULL, 10) : getEpochSeconds();
+		return printRanks(time) ? 0 : 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--wal")) {
+			g_statWalMode = true;
+		}
+		else if (!strcmp(argv[i], "--direct")) {
+			g_directQueryMode = true;
+		}
+		else if (!strcmp(argv[i], "--rank-formula") && i + 1 < argc) {
+			if (!rank_select_formula(argv[++i])) {
+				printf("Unknown rank formula: %s\n", argv[i]);
+				return 0;
+			}
+		}
+		else {
+			printf("Unknown option: %s\n", argv[i]);
+			return 0;
+		}
+	}
+
 	a2s_init();
 
 	appid = argv[1];
@@ -1517,11 +2207,34 @@ int main(int argc, char** argv) {
 		printf("Failed to create folder: %s\n", archiveRankPath.c_str());
 		return 0;
 	}
+	if (!dirExists(rttDataPath) && !createDir(rttDataPath)) {
+		printf("Failed to create folder: %s\n", rttDataPath.c_str());
+		return 0;
+	}
+	if (!dirExists(archiveRttPath) && !createDir(archiveRttPath)) {
+		printf("Failed to create folder: %s\n", archiveRttPath.c_str());
+		return 0;
+	}
 	
 	load_ip_cache();
 	apikey = loadApiKey("api_key.txt");
 
-	if (!apikey.length() || !loadServerInfos()) {
+	if (!apikey.length()) {
+		return 0;
+	}
+
+	// fold stats from a previous run into the stat files before they're loaded
+	if (!wal_replay() || (g_statWalMode && !wal_init())) {
+		return 0;
+	}
+
+	if (!rank_init()) {
+		return 0;
+	}
+
+	initStatFileCache();
+
+	if (!loadServerInfos()) {
 		return 0;
 	}
 	
@@ -1530,22 +2243,38 @@ int main(int argc, char** argv) {
 	uint64_t nextWriteTime = startTime + ((uint64_t)(STAT_WRITE_FREQ * 1000) * writeCount);
 	
 	uint64_t updateStartTime = getEpochMillis();
+	uint32_t lastServerListTime = 0;
+
+	// time spent in each stage of an update (ms). The server list and A2S results are
+	// processed by the stats and saving stages after the wait for the next update.
+	uint64_t fetchMillis = 0;
+	uint64_t a2sMillis = 0;
+	uint64_t statsMillis = 0;
+	uint64_t saveMillis = 0;
 
 	printf("Startup finished. Begin scanning\n\n");
 	
 	while (1) {
-		uint64_t fetchStartTime = getEpochMillis();
+		// in direct query mode, the server list is only needed to find new servers
+		bool fetchServerList = !g_directQueryMode || getEpochSeconds() - lastServerListTime >= SERVER_LIST_FREQ;
+
 		Document json;
 		Value& serverList = json;
-		while (!getServerListJson(serverList, json)) {
-			this_thread::sleep_for(seconds(10));
-		}	
-
-		cleanupServerListJson(json, serverList);
+		thread fetchThread;
+		fetchMillis = 0;
+		if (fetchServerList) {
+			fetchThread = thread(serverListThread, ref(json), ref(fetchMillis));
+		}
 
-		printf("Server list fetched in %.1fs.\n", (getEpochMillis() - fetchStartTime) / 1000.0f);
+		uint64_t a2sStartTime = getEpochMillis();
+		a2s_query_all(!fetchServerList);
+		a2sMillis = getEpochMillis() - a2sStartTime;
 
-		a2s_query_all();
+		if (fetchThread.joinable()) {
+			fetchThread.join();
+			lastServerListTime = getEpochSeconds();
+			printf("Server list fetched in %.1fs.\n", fetchMillis / 1000.0f);
+		}
 
 		printf("Total update time: %.2fs\n\n", (getEpochMillis() - updateStartTime) / 1000.0f);
 		
@@ -1559,20 +2288,34 @@ int main(int argc, char** argv) {
 
 		updateStartTime = getEpochMillis();
 		g_lastUpdateTime = getEpochSeconds();
-		updateStats(json, serverList, g_lastUpdateTime);
+		vector<ServerState> responses;
+		if (fetchServerList) {
+			parseServerList(serverList, responses);
+		}
+		else {
+			getA2SResponses(responses);
+		}
+		updateRttStats(g_lastUpdateTime); // queued before updateStats flushes the stat files
+		updateStats(responses, g_lastUpdateTime);
+		statsMillis = getEpochMillis() - updateStartTime;
 
 		uint32_t nowSecs = getEpochSeconds();
-		if (nowSecs - g_lastRankTime > RANK_FREQ) {
+		updateRankSums(nowSecs); // rank sums in the server list are kept current between rank file updates
+
+		if (nowSecs - g_lastRankTime > RANK_FREQ && computeRanks(nowSecs)) {
 			g_lastRankTime = nowSecs;
-			uint64_t start = getEpochMillis();
-			g_writeStats.bytesRead = 0;
-			computeRanks();
-			printf("Updated ranks in %.2fs, %.1f MB read\n", (getEpochMillis() - start) / 1000.0f, g_writeStats.bytesRead / (1024.0f*1024.0f));
 		}
+		rank_poll();
 
-		printf("Updated %d/%d servers, wrote %d bytes\n", g_writeStats.serversUpdated, (int)g_servers.size(), g_writeStats.bytesWritten);
+		printf("Updated %d/%d servers, wrote %d bytes to %d files in %.2fms\n", g_writeStats.serversUpdated, (int)g_servers.size(),
+			g_writeStats.bytesWritten, g_writeStats.filesFlushed, g_writeStats.flushMicros / 1000.0f);
 
+		uint64_t saveStartTime = getEpochMillis();
 		saveServerInfos();
+		saveMillis = getEpochMillis() - saveStartTime;
+
+		printf("Update stages: server list %.2fs, A2S %.2fs (in parallel), stats %.2fs, saving %.2fs\n",
+			fetchMillis / 1000.0f, a2sMillis / 1000.0f, statsMillis / 1000.0f, saveMillis / 1000.0f);
 
 		do {
 			writeCount++;
@@ -1580,7 +2323,9 @@ int main(int argc, char** argv) {
 		} while (nextWriteTime < now);
 	}
 	
+	rank_wait();
 	a2s_cleanup();
+	wal_cleanup();
 
 	return 0;
 }
\ No newline at end of file
@@ -1,13 +1,52 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "statfile.h"
+#include "statsum.h"
+#include "rank.h"
+
+
+#define RTT_MAX_PASSES 16 // A2S passes that a round trip time stat can cover
 
 struct Player {
-	std::string name;
+	uint32_t name; // offset of the name in the player list's name buffer
+	uint32_t nameLen;
 	int score;
 	float duration;
 };
 
+// Players of many servers. Names are kept in one buffer, so that filling the list again doesn't allocate
+// once the buffers have grown.
+struct PlayerList {
+	std::vector<Player> players;
+	std::vector<char> names;
+
+	void clear() {
+		players.clear();
+		names.clear();
+	}
+
+	std::string getName(const Player& plr) const {
+		return std::string(names.data() + plr.name, plr.nameLen);
+	}
+};
+
+// server info from an A2S_INFO response
+struct A2SInfo {
+	std::string name;
+	std::string map;
+	uint8_t players;
+	uint8_t maxPlayers;
+	uint8_t bots;
+	char serverType; // 'd' = dedicated, 'l' = listen, 'p' = proxy
+	char environment; // 'l' = linux, 'w' = windows, 'm' or 'o' = mac
+	bool vac;
+};
+
 struct ServerState {
 	std::string addr; // port separator converted to filename safe character
 	std::string name;
@@ -20,11 +59,34 @@ struct ServerState {
 
 	uint32_t lastWriteTime; // last time a player count stat was written (epoch seconds)
 	uint32_t lastResponseTime; // last time data was received for this server
-	uint32_t rankSum; // sum of player counts over rankDataPoints data points
-	int lastRank; // last rank written to file
+	uint32_t rankSums[NUM_RANK_WINDOWS]; // sums of player counts sampled over each ranking window
+	SampleWindow rankWindow; // player counts sampled over the ranking windows
+	HourlyRollups rankHours; // hourly totals of the samples, for ranking formulas
+	double rankScores[NUM_RANK_WINDOWS]; // ranking formula scores as of the last rank pass
+
+	// incremental live/avg stat file state
+	bool liveFilesValid; // false until the live/avg files are regenerated from the full history
+	uint32_t liveStartTime; // time of the first stat in the live file (0 = no stats)
+	uint32_t avgStartTime; // time of the first sample for averaged stats (0 = no stats)
+	uint32_t lastAvgStatWrite; // time of the last averaged stat
+	std::deque<StatSample> avgHistory; // stats covering the samples of the next average
 
-	std::vector<Player> a2s_players; // player info from A2S
+	uint8_t a2s_playerList; // players from A2S are in g_a2sPlayers[a2s_playerList]
+	uint32_t a2s_firstPlayer;
+	uint16_t a2s_numPlayers;
 	bool a2s_success; // true if A2S queries succeeded
+	int32_t a2s_challenge; // last A2S challenge the server accepted (0 = none)
+	A2SInfo a2s_info; // server info from A2S, in direct query mode
+	bool a2s_info_success; // true if a2s_info is from the last A2S pass
+	uint32_t a2s_rttMin; // lowest round trip time in the last A2S pass (microseconds, 0 = no responses)
+	uint32_t a2s_rttMedian; // median round trip time in the last A2S pass (microseconds)
+
+	// round trip times since the last round trip time stat (0.1 ms)
+	uint32_t rttStatStart; // time of the first pass covered by the next stat
+	uint32_t lastRttWrite; // time of the last stat written since startup (0 = none)
+	uint16_t rttMin;
+	uint16_t rttMedians[RTT_MAX_PASSES]; // median of each pass
+	uint8_t numRttMedians;
 
 	std::string getStatFilePath();
 	std::string getStatArchiveFilePath();
@@ -32,9 +94,47 @@ struct ServerState {
 	std::string getLiveAvgStatFilePath();
 	std::string getRankHistFilePath();
 	std::string getRankArchiveFilePath();
+	std::string getRttStatFilePath();
+	std::string getRttArchiveFilePath();
 	uint32_t secondsSinceLastResponse();
 	std::string displayName();
 	void init();
+	void initRankWindow();
+	void updateRankSums(uint32_t now); // slides the rank window forward to the given time
 };
 
-extern std::unordered_map<std::string, ServerState> g_servers;
\ No newline at end of file
+extern std::unordered_map<std::string, ServerState> g_servers;
+extern std::vector<PlayerList> g_a2sPlayers; // players from the last A2S pass, one list per A2S shard
+extern std::string dataStatsPath;
+extern std::string statsPath;
+extern std::string liveDataPath;
+extern std::string avgDataPath;
+extern const char* statFileMagicBytes;
+extern const char* rankFileMagicBytes;
+
+struct StatBlockWriter;
+
+// creates an empty stat file for a new server, or loads the history of a server that was tracked before
+bool createServerStatFile(ServerState& newState);
+
+bool writeStatHeader(FILE* file, const char* magic, std::string fpath, uint32_t version = STAT_FILE_VERSION);
+
+int encodeStat(uint32_t prevTime, const StatSample& stat, uint8_t* out);
+
+bool openStatWriter(ServerState& state, StatBlockWriter& writer);
+
+bool writeLiveStatFiles(ServerState& state, uint32_t now);
+
+bool trimLiveStatFile(ServerState& state, uint32_t now);
+
+bool encodeLiveStats(ServerState& state, const uint8_t* stat, int statLen, uint32_t now,
+	std::vector<uint8_t>& liveData, std::vector<uint8_t>& avgData, bool& needsTrim);
+
+// points the stat folders at a folder for tests and creates them. Returns false if that failed.
+bool useTestDataPath(const std::string& path);
+
+// reads an entire file for tests, or returns an empty buffer if it can't be read
+std::vector<uint8_t> readTestFile(const std::string& path);
+
+// decodes a server's stat history for tests
+std::vector<StatSample> readTestStats(ServerState& state);
\ No newline at end of file
@@ -0,0 +1,963 @@
+#include "rank.h"
+#include "main.h"
+#include "util.h"
+#include "statdecode.h"
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include <math.h>
+
+#define RANK_STORE_VERSION 1
+#define RANK_KEYFRAME_INTERVAL (60*60*24*7) // minimum seconds between epochs that hold every rank
+#define FL_EPOCH_KEYFRAME 1
+
+#pragma pack(push, 1)
+struct RankEpochHeader {
+	uint32_t time; // time of the rank pass
+	uint32_t size; // bytes of dictionary entries and ranks following the header
+	uint16_t newIds; // server IDs added to the dictionary. Keyframes restart the dictionary.
+	uint16_t flags;
+};
+
+struct RankKeyframe {
+	uint32_t time;
+	uint32_t offset;
+};
+#pragma pack(pop)
+
+// An epoch is followed by its dictionary entries (length byte + server ID), then a varint count.
+// Keyframes then have a varint rank for every server in the dictionary. Other epochs have
+// (varint store ID gap, varint zigzag rank change) for each rank that changed. Ranks are stored
+// plus one so that untracked servers take a single byte.
+
+const char* rankStoreMagicBytes = "SVRS";
+const char* rankIndexMagicBytes = "SVRI";
+
+const RankWindow g_rankWindows[NUM_RANK_WINDOWS] = {
+	{"24h", 60*60*24},
+	{"7d", 60*60*24*7},
+	{"14d", 60*60*24*14},
+	{"30d", 60*60*24*30},
+};
+
+#define SAMPLES_PER_HOUR (3600 / RANK_STAT_INTERVAL)
+
+// average player count over the window
+double scoreSum(const ServerState& state, int window, uint32_t now) {
+	return state.rankSums[window] / (double)(g_rankWindows[window].length / RANK_STAT_INTERVAL);
+}
+
+// average player count, with the weight of each hour halving every quarter of the window
+double scoreRecent(const ServerState& state, int window, uint32_t now) {
+	uint32_t numHours = g_rankWindows[window].length / 3600;
+	uint32_t lastHour = now / 3600;
+	double halfLife = numHours / 4.0;
+	double total = 0;
+	double weights = 0;
+
+	for (uint32_t age = 0; age < numHours; age++) {
+		const HourRollup* rollup = state.rankHours.get(lastHour - age);
+		double weight = exp2(-(double)age / halfLife);
+		total += rollup ? weight * rollup->sum : 0;
+		weights += weight * SAMPLES_PER_HOUR;
+	}
+
+	return total / weights;
+}
+
+// average of the highest player count seen each day
+double scorePeak(const ServerState& state, int window, uint32_t now) {
+	uint32_t numDays = g_rankWindows[window].length / (3600 * 24);
+	uint32_t lastHour = now / 3600;
+	uint32_t total = 0;
+
+	for (uint32_t day = 0; day < numDays; day++) {
+		uint8_t dayPeak = 0;
+
+		for (uint32_t age = day * 24; age < (day + 1) * 24; age++) {
+			const HourRollup* rollup = state.rankHours.get(lastHour - age);
+			if (rollup && rollup->peak > dayPeak) {
+				dayPeak = rollup->peak;
+			}
+		}
+
+		total += dayPeak;
+	}
+
+	return total / (double)numDays;
+}
+
+// sums the samples and unreachable samples in the hourly rollups of a window
+void sumRollups(const ServerState& state, int window, uint32_t now, uint64_t& sum, uint32_t& unreachable) {
+	uint32_t numHours = g_rankWindows[window].length / 3600;
+	uint32_t lastHour = now / 3600;
+	sum = 0;
+	unreachable = 0;
+
+	for (uint32_t age = 0; age < numHours; age++) {
+		const HourRollup* rollup = state.rankHours.get(lastHour - age);
+		if (rollup) {
+			sum += rollup->sum;
+			unreachable += rollup->unreachable;
+		}
+	}
+}
+
+// fraction of player slots that were filled
+double scoreCapacity(const ServerState& state, int window, uint32_t now) {
+	if (!state.maxPlayers) {
+		return 0;
+	}
+
+	uint64_t sum;
+	uint32_t unreachable;
+	sumRollups(state, window, now, sum, unreachable);
+
+	uint32_t numSamples = g_rankWindows[window].length / 3600 * SAMPLES_PER_HOUR;
+	return sum / ((double)numSamples * state.maxPlayers);
+}
+
+// average player count, scaled down by the fraction of the window the server was unreachable
+double scoreReachable(const ServerState& state, int window, uint32_t now) {
+	uint64_t sum;
+	uint32_t unreachable;
+	sumRollups(state, window, now, sum, unreachable);
+
+	uint32_t numSamples = g_rankWindows[window].length / 3600 * SAMPLES_PER_HOUR;
+	return (sum / (double)numSamples) * (1.0 - unreachable / (double)numSamples);
+}
+
+const RankFormula g_rankFormulas[] = {
+	{"sum", "average player count", scoreSum},
+	{"recent", "average player count, weighted towards recent hours", scoreRecent},
+	{"peak", "average daily peak player count", scorePeak},
+	{"capacity", "fraction of player slots filled", scoreCapacity},
+	{"reachable", "average player count, penalized for unreachable time", scoreReachable},
+};
+const int g_numRankFormulas = sizeof(g_rankFormulas) / sizeof(RankFormula);
+const RankFormula* g_rankFormula = &g_rankFormulas[0];
+
+bool rank_select_formula(const char* name) {
+	for (int i = 0; i < g_numRankFormulas; i++) {
+		if (!strcmp(g_rankFormulas[i].name, name)) {
+			g_rankFormula = &g_rankFormulas[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+string getRankStoreName(int window) {
+	if (window == RANK_WINDOW_DEFAULT) {
+		return dataStatsPath + "ranks";
+	}
+	return dataStatsPath + "ranks_" + g_rankWindows[window].name;
+}
+
+string getRankStorePath(int window) {
+	return getRankStoreName(window) + ".dat";
+}
+
+string getRankIndexPath(int window) {
+	return getRankStoreName(window) + ".idx";
+}
+
+struct RankStore {
+	int window = RANK_WINDOW_DEFAULT;
+	vector<string> serverIds; // dictionary, indexed by store ID
+	unordered_map<string, uint32_t> storeIds;
+	vector<uint16_t> ranks; // ranks as of the last epoch, indexed by store ID
+	vector<bool> trackedIds; // servers ranked since the last keyframe, indexed by store ID. The rest are dropped by the next keyframe.
+	uint32_t lastTime = 0; // time of the last epoch
+	uint32_t lastKeyframeTime = 0;
+
+	vector<RankKeyframe> keyframes;
+	size_t savedKeyframes = 0; // keyframes already in the index file
+	size_t fileSize = 0; // end of the last complete epoch (0 = file not created)
+	size_t writtenIds = 0; // dictionary entries in the file since the last keyframe
+	bool truncate = false; // file has bytes after the last complete epoch
+
+	// loads ranks as of the last epoch at or before the given time
+	bool load(uint32_t time);
+
+	// appends an epoch if any ranks changed. Ranks are indexed by store ID.
+	bool append(uint32_t time, const vector<uint16_t>& newRanks, int& changes, int& bytes);
+
+	// returns the store ID for a server, adding it to the dictionary if it's new
+	uint32_t getId(const string& serverId);
+
+private:
+	// removes servers that haven't been ranked since the last keyframe from the dictionary
+	void pruneIds(vector<uint16_t>& newRanks);
+	void loadIndex(size_t dataSize);
+	bool saveIndex();
+	bool readEpoch(StatCursor& cursor, const RankEpochHeader& header);
+};
+
+struct RankPass {
+	uint32_t time;
+	vector<ServerRank> ranks;
+	bool written;
+	int changes;
+	int bytes;
+	uint64_t cpuMicros;
+	uint64_t startTime;
+	uint64_t wallMicros;
+};
+
+RankStore g_rankStores[NUM_RANK_WINDOWS]; // owned by the pass thread while a pass is running
+RankPass g_rankPass;
+std::thread g_rankThread;
+std::atomic<bool> g_rankDone(false);
+
+uint32_t RankStore::getId(const string& serverId) {
+	auto id = storeIds.find(serverId);
+	if (id != storeIds.end()) {
+		return id->second;
+	}
+
+	serverIds.push_back(serverId);
+	ranks.push_back(RANK_UNTRACKED);
+	trackedIds.push_back(true);
+	storeIds[serverId] = serverIds.size() - 1;
+	return serverIds.size() - 1;
+}
+
+void RankStore::pruneIds(vector<uint16_t>& newRanks) {
+	size_t kept = 0;
+
+	for (size_t i = 0; i < serverIds.size(); i++) {
+		if (!trackedIds[i] && newRanks[i] == RANK_UNTRACKED) {
+			storeIds.erase(serverIds[i]);
+			continue;
+		}
+
+		if (kept != i) {
+			serverIds[kept].swap(serverIds[i]);
+			storeIds[serverIds[kept]] = kept;
+			ranks[kept] = ranks[i];
+			newRanks[kept] = newRanks[i];
+			trackedIds[kept] = trackedIds[i];
+		}
+		kept++;
+	}
+
+	serverIds.resize(kept);
+	ranks.resize(kept);
+	newRanks.resize(kept);
+	trackedIds.resize(kept);
+}
+
+void RankStore::loadIndex(size_t dataSize) {
+	keyframes.clear();
+	savedKeyframes = 0;
+
+	MappedFile file;
+	if (!file.open(getRankIndexPath(window))) {
+		return; // rebuilt as keyframes are decoded
+	}
+
+	StatCursor cursor = file.cursor();
+	StatFileHeader header;
+
+	if (!cursor.read(header) || header.version != RANK_STORE_VERSION || strncmp(header.magic, rankIndexMagicBytes, 4)) {
+		printf("Invalid rank index: %s\n", getRankIndexPath(window).c_str());
+		return;
+	}
+
+	RankKeyframe key;
+	while (cursor.read(key)) {
+		bool ordered = keyframes.empty()
+			|| (key.time >= keyframes.back().time && key.offset > keyframes.back().offset);
+
+		if (!ordered || key.offset >= dataSize) {
+			printf("Discarding stale rank index: %s\n", getRankIndexPath(window).c_str());
+			keyframes.clear();
+			return;
+		}
+
+		keyframes.push_back(key);
+	}
+
+	savedKeyframes = keyframes.size();
+}
+
+bool RankStore::saveIndex() {
+	if (savedKeyframes == keyframes.size()) {
+		return true;
+	}
+
+	string path = getRankIndexPath(window);
+	bool newFile = savedKeyframes == 0;
+
+	errno = 0;
+	FILE* file = fopen(path.c_str(), newFile ? "wb" : "ab");
+	if (!file) {
+		printf("Failed to open rank index (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	if (newFile) {
+		StatFileHeader header;
+		header.version = RANK_STORE_VERSION;
+		memcpy(header.magic, rankIndexMagicBytes, 4);
+
+		if (!fwrite(&header, sizeof(StatFileHeader), 1, file)) {
+			printf("Failed to write rank index header: %s\n", path.c_str());
+			fclose(file);
+			remove(path.c_str());
+			return false;
+		}
+	}
+
+	size_t newKeys = keyframes.size() - savedKeyframes;
+	if (fwrite(&keyframes[savedKeyframes], sizeof(RankKeyframe), newKeys, file) != newKeys) {
+		printf("Failed to write rank index: %s\n", path.c_str());
+		fclose(file);
+		remove(path.c_str()); // rebuilt on the next load
+		savedKeyframes = 0;
+		return false;
+	}
+
+	fclose(file);
+	savedKeyframes = keyframes.size();
+	return true;
+}
+
+bool RankStore::readEpoch(StatCursor& cursor, const RankEpochHeader& header) {
+	bool keyframe = header.flags & FL_EPOCH_KEYFRAME;
+
+	if (keyframe) {
+		serverIds.clear();
+		storeIds.clear();
+		ranks.clear();
+		trackedIds.clear();
+	}
+
+	for (int i = 0; i < header.newIds; i++) {
+		uint8_t len;
+		if (!cursor.read(len) || (size_t)(cursor.end - cursor.pos) < len) {
+			return false;
+		}
+		getId(string((const char*)cursor.pos, len));
+		cursor.pos += len;
+	}
+
+	uint32_t count;
+	if (!cursor.readVarint(count) || (keyframe && count != ranks.size()) || count > ranks.size()) {
+		return false;
+	}
+
+	uint32_t id = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t value;
+
+		if (keyframe) {
+			if (!cursor.readVarint(value) || value > 0xffff) {
+				return false;
+			}
+			ranks[i] = value - 1;
+			trackedIds[i] = ranks[i] != RANK_UNTRACKED;
+			continue;
+		}
+
+		uint32_t gap;
+		if (!cursor.readVarint(gap) || !cursor.readVarint(value)) {
+			return false;
+		}
+		id += gap;
+		if (id >= ranks.size()) {
+			return false;
+		}
+
+		int change = (value & 1) ? -(int)(value >> 1) - 1 : (int)(value >> 1);
+		int stored = (uint16_t)(ranks[id] + 1) + change;
+		if (stored < 0 || stored > 0xffff) {
+			return false;
+		}
+		ranks[id] = stored - 1;
+		trackedIds[id] = true;
+		id++;
+	}
+
+	return cursor.eof();
+}
+
+bool RankStore::load(uint32_t time) {
+	string path = getRankStorePath(window);
+
+	MappedFile file;
+	if (!fileExists(path)) {
+		return true; // no ranks written yet
+	}
+	if (!file.open(path)) {
+		printf("Failed to open rank store: %s\n", path.c_str());
+		return false;
+	}
+
+	StatCursor cursor = file.cursor();
+	StatFileHeader header;
+
+	if (!cursor.read(header) || header.version != RANK_STORE_VERSION || strncmp(header.magic, rankStoreMagicBytes, 4)) {
+		printf("Invalid rank store header: %s\n", path.c_str());
+		return false;
+	}
+
+	loadIndex(file.size);
+
+	// start from the last keyframe at or before the time
+	int low = 0;
+	int high = (int)keyframes.size() - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (keyframes[mid].time <= time) {
+			cursor.pos = file.data + keyframes[mid].offset;
+			low = mid + 1;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+
+	size_t lastIndexed = keyframes.size() ? keyframes.back().offset : 0;
+	fileSize = cursor.tell();
+
+	while (!cursor.eof()) {
+		size_t offset = cursor.tell();
+		RankEpochHeader epoch;
+
+		if (!cursor.read(epoch) || (size_t)(cursor.end - cursor.pos) < epoch.size) {
+			printf("Discarding incomplete rank epoch at offset %u: %s\n", (uint32_t)offset, path.c_str());
+			truncate = true;
+			break;
+		}
+		if (epoch.time > time) {
+			break;
+		}
+
+		StatCursor payload(cursor.pos, epoch.size);
+		cursor.pos += epoch.size;
+
+		if (!readEpoch(payload, epoch)) {
+			printf("Invalid rank epoch at offset %u: %s\n", (uint32_t)offset, path.c_str());
+			return false;
+		}
+
+		if (epoch.flags & FL_EPOCH_KEYFRAME) {
+			lastKeyframeTime = epoch.time;
+			if (offset > lastIndexed) {
+				RankKeyframe key;
+				key.time = epoch.time;
+				key.offset = offset;
+				keyframes.push_back(key);
+			}
+		}
+
+		lastTime = epoch.time;
+		writtenIds = serverIds.size();
+		fileSize = cursor.tell();
+	}
+
+	return true;
+}
+
+bool RankStore::append(uint32_t time, const vector<uint16_t>& newRanks, int& changes, int& bytes) {
+	changes = 0;
+	bytes = 0;
+
+	if (time < lastTime) {
+		printf("Rank time went backwards (%u < %u)\n", time, lastTime);
+		return false;
+	}
+
+	bool keyframe = lastKeyframeTime == 0 || time - lastKeyframeTime >= RANK_KEYFRAME_INTERVAL;
+	size_t firstNewId = keyframe ? 0 : writtenIds;
+
+	// Keyframes write the whole dictionary, so a failed write leaves the store
+	// consistent and the next epoch is a keyframe again
+	vector<uint16_t> keptRanks;
+	if (keyframe) {
+		keptRanks = newRanks;
+		pruneIds(keptRanks);
+	}
+	const vector<uint16_t>& epochRanks = keyframe ? keptRanks : newRanks;
+
+	vector<uint8_t> data;
+	uint8_t buffer[16];
+
+	for (size_t i = firstNewId; i < serverIds.size(); i++) {
+		data.push_back(serverIds[i].size());
+		data.insert(data.end(), serverIds[i].begin(), serverIds[i].end());
+	}
+
+	vector<uint8_t> values;
+	uint32_t lastId = 0;
+
+	for (uint32_t i = 0; i < epochRanks.size(); i++) {
+		uint16_t stored = epochRanks[i] + 1;
+
+		if (keyframe) {
+			values.insert(values.end(), buffer, buffer + writeVarint(stored, buffer));
+		}
+		if (epochRanks[i] == ranks[i]) {
+			continue;
+		}
+
+		changes++;
+		if (!keyframe) {
+			int change = (int)stored - (int)(uint16_t)(ranks[i] + 1);
+			uint32_t zigzag = change >= 0 ? change * 2 : -change * 2 - 1;
+			int len = writeVarint(i - lastId, buffer);
+			len += writeVarint(zigzag, buffer + len);
+			values.insert(values.end(), buffer, buffer + len);
+			lastId = i + 1;
+		}
+	}
+
+	if (!keyframe && !changes && writtenIds == serverIds.size()) {
+		return true; // no delta to write
+	}
+
+	data.insert(data.end(), buffer, buffer + writeVarint(keyframe ? epochRanks.size() : changes, buffer));
+	data.insert(data.end(), values.begin(), values.end());
+
+	RankEpochHeader epoch;
+	epoch.time = time;
+	epoch.size = data.size();
+	epoch.newIds = serverIds.size() - firstNewId;
+	epoch.flags = keyframe ? FL_EPOCH_KEYFRAME : 0;
+
+	string path = getRankStorePath(window);
+	bool newFile = fileSize == 0;
+
+	errno = 0;
+	FILE* file = fopen(path.c_str(), newFile ? "wb" : "r+b");
+	if (!file) {
+		printf("Failed to open rank store (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	if (newFile) {
+		if (!writeStatHeader(file, rankStoreMagicBytes, path, RANK_STORE_VERSION)) {
+			fclose(file);
+			return false;
+		}
+		fileSize = sizeof(StatFileHeader);
+		keyframes.clear();
+		savedKeyframes = 0;
+	}
+	else if (fseek(file, fileSize, SEEK_SET)) {
+		printf("Failed to seek rank store: %s\n", path.c_str());
+		fclose(file);
+		return false;
+	}
+
+	if (!fwrite(&epoch, sizeof(RankEpochHeader), 1, file) || !fwrite(&data[0], data.size(), 1, file)) {
+		printf("Failed to write rank epoch: %s\n", path.c_str());
+		fclose(file);
+		truncate = true; // part of the epoch may have been written
+		return false;
+	}
+
+	size_t offset = fileSize;
+	fileSize += sizeof(RankEpochHeader) + data.size();
+
+	if (truncate) {
+		truncate = !truncateFile(file, fileSize);
+	}
+	fclose(file);
+
+	for (size_t i = 0; i < epochRanks.size(); i++) {
+		bool tracked = epochRanks[i] != RANK_UNTRACKED;
+		trackedIds[i] = keyframe ? tracked : trackedIds[i] || tracked;
+	}
+
+	ranks = epochRanks;
+	lastTime = time;
+	writtenIds = serverIds.size();
+	bytes = sizeof(RankEpochHeader) + data.size();
+
+	if (keyframe) {
+		lastKeyframeTime = time;
+
+		RankKeyframe key;
+		key.time = time;
+		key.offset = offset;
+		keyframes.push_back(key);
+		saveIndex();
+	}
+
+	return true;
+}
+
+// converts per-server rank files from older versions into rank store epochs
+bool importRankFiles(RankStore& store) {
+	string legacyPath = dataStatsPath + "rank/";
+	vector<string> files = getDirFiles(legacyPath, "dat", "");
+	if (files.empty()) {
+		return true;
+	}
+
+	std::sort(files.begin(), files.end());
+
+	struct ImportedRank {
+		uint32_t time;
+		uint32_t server; // index into serverIds. Store IDs change when keyframes prune the dictionary.
+		uint16_t rank;
+	};
+	vector<ImportedRank> imported;
+	vector<string> serverIds;
+
+	for (string& fname : files) {
+		string fpath = legacyPath + fname;
+		MappedFile file;
+		StatFileHeader header;
+
+		if (!file.open(fpath)) {
+			printf("Failed to open rank file: %s\n", fpath.c_str());
+			continue;
+		}
+
+		StatCursor cursor = file.cursor();
+		if (!cursor.read(header) || header.version != STAT_FILE_VERSION || strncmp(header.magic, rankFileMagicBytes, 4)) {
+			printf("Skipping invalid rank file: %s\n", fpath.c_str());
+			continue;
+		}
+
+		uint32_t server = serverIds.size();
+		serverIds.push_back(fname.substr(0, fname.find_last_of(".")));
+
+		bool validRanks = decodeRanks(cursor, [&](const RankRecord& rec) {
+			ImportedRank rank;
+			rank.time = rec.time;
+			rank.server = server;
+			rank.rank = rec.rank;
+			imported.push_back(rank);
+			return true;
+		});
+
+		if (!validRanks) {
+			printf("Imported part of corrupt rank file: %s\n", fpath.c_str());
+		}
+	}
+
+	std::stable_sort(imported.begin(), imported.end(), [](const ImportedRank& a, const ImportedRank& b) {
+		return a.time < b.time;
+	});
+
+	// rank passes wrote the ranks that changed, all with the same time
+	vector<uint16_t> ranks;
+	int numEpochs = 0;
+
+	for (size_t i = 0; i < imported.size(); ) {
+		uint32_t time = imported[i].time;
+		size_t end = i;
+		for (; end < imported.size() && imported[end].time == time; end++) {
+			store.getId(serverIds[imported[end].server]);
+		}
+
+		ranks = store.ranks;
+		for (; i < end; i++) {
+			ranks[store.getId(serverIds[imported[i].server])] = imported[i].rank;
+		}
+
+		int changes, bytes;
+		if (!store.append(time, ranks, changes, bytes)) {
+			return false;
+		}
+		numEpochs++;
+	}
+
+	printf("Imported %d rank files as %d epochs (%.1f KB)\n", (int)files.size(), numEpochs, store.fileSize / 1024.0f);
+	return true;
+}
+
+bool rank_init() {
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		RankStore& store = g_rankStores[w];
+		store.window = w;
+
+		bool newStore = !fileExists(getRankStorePath(w));
+
+		if (!store.load(UINT32_MAX)) {
+			return false;
+		}
+
+		// legacy rank files were only written for the default window
+		if (newStore && w == RANK_WINDOW_DEFAULT && !importRankFiles(store)) {
+			printf("Failed to import rank files\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void rankPassThread() {
+	uint64_t cpuStart = getThreadCpuMicros();
+	g_rankPass.written = true;
+
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		RankStore& store = g_rankStores[w];
+
+		for (ServerRank& rank : g_rankPass.ranks) {
+			store.getId(rank.serverId);
+		}
+
+		vector<uint16_t> ranks(store.serverIds.size(), RANK_UNTRACKED);
+		for (ServerRank& rank : g_rankPass.ranks) {
+			ranks[store.getId(rank.serverId)] = rank.ranks[w];
+		}
+
+		int changes, bytes;
+		if (!store.append(g_rankPass.time, ranks, changes, bytes)) {
+			g_rankPass.written = false;
+		}
+		g_rankPass.changes += changes;
+		g_rankPass.bytes += bytes;
+	}
+
+	g_rankPass.cpuMicros = getThreadCpuMicros() - cpuStart;
+	g_rankPass.wallMicros = getEpochMicros() - g_rankPass.startTime;
+	g_rankDone = true;
+}
+
+bool rank_start(uint32_t now, vector<ServerRank>& ranks) {
+	if (rank_running()) {
+		return false;
+	}
+
+	g_rankPass.time = now;
+	g_rankPass.ranks.swap(ranks);
+	g_rankPass.written = false;
+	g_rankPass.changes = 0;
+	g_rankPass.bytes = 0;
+	g_rankPass.cpuMicros = 0;
+	g_rankPass.startTime = getEpochMicros();
+	g_rankPass.wallMicros = 0;
+
+	g_rankDone = false;
+	g_rankThread = std::thread(rankPassThread);
+
+	return true;
+}
+
+bool rank_running() {
+	return g_rankThread.joinable();
+}
+
+// reports a pass after its thread has been joined
+void finishRankPass() {
+	if (g_rankPass.written) {
+		// throughput of the store writes, comparable to the files/s of per-server rank files
+		int numRanks = (int)g_rankPass.ranks.size() * NUM_RANK_WINDOWS;
+		double seconds = (g_rankPass.wallMicros ? g_rankPass.wallMicros : 1) / 1000000.0;
+
+		printf("Rank pass: %d/%d ranks changed, wrote %d bytes in %.2fms (%.2fms CPU, %.0f ranks/s)\n", g_rankPass.changes,
+			numRanks, g_rankPass.bytes, g_rankPass.wallMicros / 1000.0f, g_rankPass.cpuMicros / 1000.0f, numRanks / seconds);
+	}
+	g_rankPass.ranks.clear();
+}
+
+bool rank_poll() {
+	if (!rank_running() || !g_rankDone) {
+		return false;
+	}
+
+	g_rankThread.join();
+	finishRankPass();
+	return true;
+}
+
+void rank_wait() {
+	if (!rank_running()) {
+		return;
+	}
+
+	g_rankThread.join();
+	finishRankPass();
+}
+
+bool rank_load(uint32_t time, vector<ServerRank>& ranks, uint32_t& epochTime) {
+	unordered_map<string, size_t> rankIdx;
+	ranks.clear();
+	epochTime = 0;
+
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		RankStore store;
+		store.window = w;
+
+		if (!store.load(time)) {
+			return false;
+		}
+
+		for (size_t i = 0; i < store.serverIds.size(); i++) {
+			if (store.ranks[i] == RANK_UNTRACKED) {
+				continue;
+			}
+
+			auto idx = rankIdx.find(store.serverIds[i]);
+			if (idx == rankIdx.end()) {
+				ServerRank rank;
+				rank.serverId = store.serverIds[i];
+				for (int k = 0; k < NUM_RANK_WINDOWS; k++) {
+					rank.ranks[k] = RANK_UNTRACKED;
+				}
+				idx = rankIdx.emplace(rank.serverId, ranks.size()).first;
+				ranks.push_back(rank);
+			}
+
+			ranks[idx->second].ranks[w] = store.ranks[i];
+		}
+
+		epochTime = store.lastTime > epochTime ? store.lastTime : epochTime;
+	}
+
+	return true;
+}
+
+// ranks a test server had in a pass, or RANK_UNTRACKED in windows it wasn't ranked in
+uint16_t getTestRank(int server, int pass, int window) {
+	if ((server + pass + window) % 7 == 0) {
+		return RANK_UNTRACKED;
+	}
+	return (server + pass / 4 + window) % 50;
+}
+
+int rank_test() {
+	if (!useTestDataPath("ranktest/")) {
+		return 1;
+	}
+
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		remove(getRankStorePath(w).c_str());
+		remove(getRankIndexPath(w).c_str());
+	}
+
+	if (!rank_init()) {
+		return 1;
+	}
+
+	// passes every 6 hours for 3 weeks, so the store has 3 keyframes.
+	// Server k is tracked for 20 passes starting at pass k*2.
+	const uint32_t passInterval = 60 * 60 * 6;
+	const int numPasses = (RANK_KEYFRAME_INTERVAL / passInterval) * 3;
+	const int numServers = 40;
+	const int trackedPasses = 20;
+	uint32_t startTime = 1000000000;
+
+	for (int pass = 0; pass < numPasses; pass++) {
+		vector<ServerRank> ranks;
+
+		for (int k = 0; k < numServers; k++) {
+			if (pass < k * 2 || pass >= k * 2 + trackedPasses) {
+				continue;
+			}
+
+			ServerRank rank;
+			rank.serverId = "10.0.0." + std::to_string(k) + "_27015";
+			for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+				rank.ranks[w] = getTestRank(k, pass, w);
+			}
+			ranks.push_back(rank);
+		}
+
+		if (!rank_start(startTime + pass * passInterval, ranks)) {
+			return 1;
+		}
+		rank_wait();
+	}
+
+	int failures = 0;
+
+	// ranks at each pass, and between passes, are the ones set by that pass
+	int mismatches = 0;
+	for (int pass = 0; pass < numPasses; pass++) {
+		uint32_t passTimes[2] = { startTime + pass * passInterval, startTime + pass * passInterval + passInterval / 2 };
+
+		for (uint32_t time : passTimes) {
+			vector<ServerRank> loaded;
+			uint32_t epochTime;
+			if (!rank_load(time, loaded, epochTime)) {
+				return 1;
+			}
+
+			int expectedServers = 0;
+			bool same = true;
+
+			for (int k = 0; k < numServers; k++) {
+				bool tracked = pass >= k * 2 && pass < k * 2 + trackedPasses;
+				string serverId = "10.0.0." + std::to_string(k) + "_27015";
+				const ServerRank* rank = NULL;
+
+				for (ServerRank& r : loaded) {
+					if (r.serverId == serverId) {
+						rank = &r;
+					}
+				}
+
+				bool ranked = false;
+				for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+					uint16_t expected = tracked ? getTestRank(k, pass, w) : RANK_UNTRACKED;
+					uint16_t actual = rank ? rank->ranks[w] : RANK_UNTRACKED;
+					ranked = ranked || expected != RANK_UNTRACKED;
+					same = same && expected == actual;
+				}
+				expectedServers += ranked ? 1 : 0;
+			}
+
+			if (!same || (int)loaded.size() != expectedServers) {
+				mismatches++;
+			}
+		}
+	}
+
+	if (mismatches) {
+		printf("FAIL: loaded ranks differ from the ranks appended at %d of %d times\n", mismatches, numPasses * 2);
+		failures++;
+	}
+	else {
+		printf("PASS: loaded ranks match the appended ranks at and between %d epochs\n", numPasses);
+	}
+
+	// The last keyframe drops servers that weren't ranked since the keyframe before it.
+	// Servers ranked in the last pass are kept.
+	int keyframePasses = RANK_KEYFRAME_INTERVAL / passInterval;
+	int lastKeyframe = ((numPasses - 1) / keyframePasses) * keyframePasses;
+	int pruneBefore = lastKeyframe - keyframePasses;
+	int wrongIds = 0;
+
+	for (int w = 0; w < NUM_RANK_WINDOWS; w++) {
+		RankStore& store = g_rankStores[w];
+
+		for (int k = 0; k < numServers; k++) {
+			int lastRanked = -1;
+			for (int pass = k * 2; pass < k * 2 + trackedPasses && pass < numPasses; pass++) {
+				if (getTestRank(k, pass, w) != RANK_UNTRACKED) {
+					lastRanked = pass;
+				}
+			}
+
+			bool stored = store.storeIds.count("10.0.0." + std::to_string(k) + "_27015") != 0;
+			bool pruned = lastRanked < pruneBefore;
+			bool kept = lastRanked == numPasses - 1;
+
+			if ((pruned && stored) || (kept && !stored)) {
+				wrongIds++;
+			}
+		}
+	}
+
+	if (wrongIds) {
+		printf("FAIL: %d rank store dictionary entries weren't pruned or kept as expected\n", wrongIds);
+		failures++;
+	}
+	else {
+		printf("PASS: keyframes pruned servers that left before the previous keyframe\n");
+	}
+
+	return failures ? 1 : 0;
+}
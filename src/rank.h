@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Rank history for all servers is kept in a single columnar file. Each rank pass appends one epoch
+// holding the ranks that changed since the previous epoch, and keyframe epochs periodically hold every
+// rank, so that the ranks of all servers at any time can be read from the nearest keyframe.
+// Rank passes run in a background thread so that they don't stall the polling loop.
+// Servers are ranked over several windows, and each window has its own rank store.
+
+#define RANK_UNTRACKED 0xffff // rank of servers that aren't tracked
+#define RANK_STAT_INTERVAL 60 // gaps between rank data points
+#define NUM_RANK_WINDOWS 4
+#define RANK_WINDOW_DEFAULT 2 // published as "rank" and stored in ranks.dat, as before there were other windows
+#define RANK_WINDOW_LONGEST (NUM_RANK_WINDOWS-1)
+
+struct RankWindow {
+	const char* name; // suffix for the rank field in tracker.json and the rank store file name
+	uint32_t length; // seconds of stats that servers are ranked by
+};
+
+extern const RankWindow g_rankWindows[NUM_RANK_WINDOWS]; // shortest first
+
+struct ServerState;
+
+// Ranking formulas score servers over a window from their hourly rollups. Higher scores rank higher,
+// and servers that scored 0 had no players.
+struct RankFormula {
+	const char* name;
+	const char* desc;
+	double (*score)(const ServerState& state, int window, uint32_t now);
+};
+
+extern const RankFormula g_rankFormulas[];
+extern const int g_numRankFormulas;
+extern const RankFormula* g_rankFormula; // formula used for rank passes
+
+struct ServerRank {
+	std::string serverId;
+	uint16_t ranks[NUM_RANK_WINDOWS];
+};
+
+// selects the ranking formula by name. Returns false if there is no such formula.
+bool rank_select_formula(const char* name);
+
+// loads the rank stores. Per-server rank files from older versions are imported into the store for
+// the default window if it doesn't exist.
+bool rank_init();
+
+// starts appending ranks for all tracked servers to the rank stores in the background.
+// Returns false if the previous pass is still running.
+bool rank_start(uint32_t now, std::vector<ServerRank>& ranks);
+
+// true until a started pass has finished and been polled with rank_poll or rank_wait
+bool rank_running();
+
+// reports a finished pass. Returns true if a pass finished.
+bool rank_poll();
+
+// waits for the current pass to finish
+void rank_wait();
+
+// reads the ranks of all servers that were tracked at the given time, in every window.
+// epochTime is set to the time of the last rank pass that changed them (0 if there wasn't one).
+bool rank_load(uint32_t time, std::vector<ServerRank>& ranks, uint32_t& epochTime);
+
+// appends rank passes for servers that come and go over several keyframes, then checks the ranks
+// loaded between epochs and the pruned dictionary. Returns 0 if it passed.
+int rank_test();
@@ -0,0 +1,419 @@
+#include "statblock.h"
+#include "statdecode.h"
+#include "main.h"
+#include "util.h"
+#include <errno.h>
+
+// encodes a stat for a v2 block (see StatFormat<2>)
+static int encodeStatRecord(uint32_t delta, const StatSample& stat, uint8_t lastPlayers, uint8_t* out) {
+	uint32_t code = STAT_CODE_ABSOLUTE;
+
+	if (stat.unreachable) {
+		code = STAT_CODE_UNREACHABLE;
+	}
+	else {
+		int change = (int)stat.players - (int)lastPlayers;
+		uint32_t zigzag = change >= 0 ? change * 2 : -change * 2 - 1;
+		if (zigzag <= STAT_CODE_MAX_DELTA) {
+			code = zigzag;
+		}
+	}
+
+	int len = writeVarint((delta << STAT_CODE_BITS) | code, out);
+	if (code == STAT_CODE_ABSOLUTE) {
+		len += writeVarint(stat.players, out + len);
+	}
+
+	return len;
+}
+
+StatBlockWriter::~StatBlockWriter() {
+	close();
+}
+
+bool StatBlockWriter::open(const std::string& path) {
+	close();
+	this->path = path;
+
+	errno = 0;
+	file = fopen(path.c_str(), "r+b");
+	if (!file) {
+		printf("Failed to open stat file (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	StatFileHeader header;
+	if (fread(&header, sizeof(StatFileHeader), 1, file) != 1 || header.version != STAT_HISTORY_VERSION) {
+		printf("Not a v%d stat file: %s\n", STAT_HISTORY_VERSION, path.c_str());
+		close();
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size_t size = ftell(file);
+
+	memset(&block, 0, sizeof(StatBlockHeader));
+	blockOffset = 0;
+	writePos = (size_t)-1; // switching from reading to writing needs a seek
+	lastStatTime = 0;
+	numSaved = 0;
+	blockSaved = 0;
+
+	if (size > sizeof(StatFileHeader)) {
+		size_t numBlocks = (size - sizeof(StatFileHeader) + STAT_BLOCK_SIZE - 1) / STAT_BLOCK_SIZE;
+		blockOffset = sizeof(StatFileHeader) + (numBlocks - 1) * STAT_BLOCK_SIZE;
+
+		fseek(file, blockOffset, SEEK_SET);
+		if (fread(&block, sizeof(StatBlockHeader), 1, file) != 1) {
+			// the program was stopped while starting this block. It will be overwritten.
+			memset(&block, 0, sizeof(StatBlockHeader));
+		}
+
+		blockSaved = block.count;
+		if (block.count) {
+			lastStatTime = block.endTime;
+		}
+		else if (numBlocks > 1) {
+			StatBlockHeader prev;
+			fseek(file, blockOffset - STAT_BLOCK_SIZE, SEEK_SET);
+			if (fread(&prev, sizeof(StatBlockHeader), 1, file) == 1) {
+				lastStatTime = prev.endTime;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool StatBlockWriter::writeAt(size_t offset, const void* data, size_t size) {
+	if (offset != writePos && fseek(file, offset, SEEK_SET)) {
+		printf("Failed to seek stat file (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	errno = 0;
+	if (size && fwrite(data, size, 1, file) != 1) {
+		printf("Failed to write stat file (error %d): %s\n", errno, path.c_str());
+		writePos = (size_t)-1;
+		return false;
+	}
+
+	writePos = offset + size;
+	return true;
+}
+
+bool StatBlockWriter::startBlock(const StatSample& stat) {
+	if (blockOffset == 0) {
+		blockOffset = sizeof(StatFileHeader);
+	}
+	else if (block.count) {
+		// finish the last block and pad it to the full block size
+		static const uint8_t padding[STAT_BLOCK_SIZE] = { 0 };
+		size_t dataEnd = blockOffset + sizeof(StatBlockHeader) + block.size;
+		size_t padSize = STAT_BLOCK_SIZE - sizeof(StatBlockHeader) - block.size;
+
+		if (!flush() || !writeAt(dataEnd, padding, padSize)) {
+			return false;
+		}
+		blockOffset += STAT_BLOCK_SIZE;
+	}
+	// else reuse the empty block
+
+	memset(&block, 0, sizeof(StatBlockHeader));
+	block.startTime = stat.time;
+	block.endTime = stat.time;
+	block.minPlayers = 255;
+	blockSaved = 0;
+
+	// readers stop at the empty header if the program is stopped before the block is flushed
+	blockDirty = true;
+	return writeAt(blockOffset, &block, sizeof(StatBlockHeader));
+}
+
+bool StatBlockWriter::append(const StatSample& stat) {
+	if (!file) {
+		return false;
+	}
+
+	uint8_t players = stat.unreachable ? 0 : stat.players;
+	uint8_t data[16];
+
+	// Blocks restart at the new time if the time goes backwards, so that block summaries stay valid.
+	// Deltas that don't fit next to the player code also start a new block.
+	uint32_t delta = stat.time - block.endTime;
+	bool newBlock = block.count == 0 || stat.time < block.endTime || block.count == 65535
+		|| delta > (UINT32_MAX >> STAT_CODE_BITS);
+
+	int len = encodeStatRecord(newBlock ? 0 : delta, stat, newBlock ? 0 : block.lastPlayers, data);
+
+	if (!newBlock && block.size + (size_t)len > STAT_BLOCK_SIZE - sizeof(StatBlockHeader)) {
+		newBlock = true;
+		len = encodeStatRecord(0, stat, 0, data);
+	}
+
+	if (newBlock) {
+		if (!startBlock(stat)) {
+			return false;
+		}
+	}
+	else {
+		block.playerSeconds += (uint64_t)block.lastPlayers * delta;
+	}
+
+	if (!writeAt(blockOffset + sizeof(StatBlockHeader) + block.size, data, len)) {
+		return false;
+	}
+
+	block.endTime = stat.time;
+	block.count++;
+	block.size += len;
+	block.lastPlayers = players;
+	block.flags = stat.unreachable ? FL_BLOCK_LAST_UNREACHABLE : 0;
+	if (players < block.minPlayers) {
+		block.minPlayers = players;
+	}
+	if (players > block.maxPlayers) {
+		block.maxPlayers = players;
+	}
+
+	blockDirty = true;
+	lastStatTime = stat.time;
+	return true;
+}
+
+bool StatBlockWriter::flush() {
+	if (!file) {
+		return false;
+	}
+
+	if (blockDirty) {
+		if (!writeAt(blockOffset, &block, sizeof(StatBlockHeader))) {
+			return false;
+		}
+		blockDirty = false;
+	}
+
+	errno = 0;
+	if (fflush(file)) {
+		printf("Failed to flush stat file (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	numSaved += block.count - blockSaved;
+	blockSaved = block.count;
+	return true;
+}
+
+void StatBlockWriter::close() {
+	if (!file) {
+		return;
+	}
+
+	flush();
+	fclose(file);
+	file = NULL;
+}
+
+StatPosition StatBlockWriter::position() const {
+	StatPosition pos;
+	pos.blockOffset = blockOffset;
+	pos.count = block.count;
+	return pos;
+}
+
+bool StatBlockWriter::countSince(const StatPosition& pos, uint64_t& count) {
+	count = 0;
+	if (!file || pos.blockOffset > blockOffset) {
+		return false;
+	}
+
+	if (pos.blockOffset == blockOffset) {
+		if (pos.count > block.count) {
+			return false;
+		}
+		count = block.count - pos.count;
+		return true;
+	}
+
+	// the block of the position was finished, and later blocks may be too
+	size_t offset = pos.blockOffset ? pos.blockOffset : sizeof(StatFileHeader);
+	uint16_t skip = pos.blockOffset ? pos.count : 0;
+	writePos = (size_t)-1; // reading moves the file position
+
+	for (; offset < blockOffset; offset += STAT_BLOCK_SIZE) {
+		StatBlockHeader header;
+		if (fseek(file, offset, SEEK_SET) || fread(&header, sizeof(StatBlockHeader), 1, file) != 1 || header.count < skip) {
+			printf("Failed to read stat block header: %s\n", path.c_str());
+			return false;
+		}
+		count += header.count - skip;
+		skip = 0;
+	}
+
+	count += block.count;
+	return true;
+}
+
+void StatBlockWriter::discard() {
+	if (!file) {
+		return;
+	}
+
+	fclose(file);
+	file = NULL;
+}
+
+bool summarizeStats(const MappedFile& file, uint32_t startTime, uint32_t endTime, StatSummary& summary) {
+	memset(&summary, 0, sizeof(StatSummary));
+	summary.startTime = endTime;
+	summary.endTime = endTime;
+	summary.minPlayers = 255;
+
+	bool known = false; // player count is known at curTime
+	uint32_t curTime = startTime;
+	uint8_t curPlayers = 0;
+
+	// integrates the current player count up to the given time
+	auto advance = [&](uint32_t time) {
+		if (time <= curTime) {
+			return;
+		}
+		if (known) {
+			summary.playerSeconds += (uint64_t)curPlayers * (time - curTime);
+			summary.minPlayers = curPlayers < summary.minPlayers ? curPlayers : summary.minPlayers;
+			summary.maxPlayers = curPlayers > summary.maxPlayers ? curPlayers : summary.maxPlayers;
+		}
+		curTime = time;
+	};
+
+	auto setKnown = [&]() {
+		if (!known) {
+			summary.startTime = curTime;
+			known = true;
+		}
+	};
+
+	int numBlocks = getStatBlockCount(file);
+	int firstBlock = (findStatBlock(file, startTime) - sizeof(StatFileHeader)) / STAT_BLOCK_SIZE;
+
+	for (int i = firstBlock; i < numBlocks; i++) {
+		StatBlockHeader block;
+		if (!readStatBlockHeader(file, i, block)) {
+			return false;
+		}
+		if (!block.count) {
+			continue;
+		}
+		if (block.startTime >= endTime) {
+			break;
+		}
+
+		if (block.startTime >= startTime && block.endTime < endTime) {
+			// entirely within the range, so the header has everything needed
+			advance(block.startTime);
+			setKnown();
+			summary.playerSeconds += block.playerSeconds;
+			summary.count += block.count;
+			summary.minPlayers = block.minPlayers < summary.minPlayers ? block.minPlayers : summary.minPlayers;
+			summary.maxPlayers = block.maxPlayers > summary.maxPlayers ? block.maxPlayers : summary.maxPlayers;
+			curTime = block.endTime;
+			curPlayers = block.lastPlayers;
+			continue;
+		}
+
+		size_t offset = getStatBlockOffset(i);
+		size_t blockEnd = offset + STAT_BLOCK_SIZE < file.size ? offset + STAT_BLOCK_SIZE : file.size;
+		StatCursor cursor(file.data, blockEnd, offset);
+
+		bool success = decodeStatBlocks(cursor, [&](const StatRecord& rec) {
+			if (rec.time >= endTime) {
+				return false;
+			}
+
+			if (rec.time >= startTime) {
+				advance(rec.time);
+				setKnown();
+				summary.count++;
+			}
+			else {
+				setKnown(); // player count at the start of the range
+			}
+
+			curPlayers = rec.players;
+			return true;
+		});
+
+		if (!success) {
+			return false;
+		}
+	}
+
+	advance(endTime);
+
+	if (!known) {
+		summary.minPlayers = 0;
+	}
+
+	return true;
+}
+
+bool upgradeStatFile(const std::string& path, bool& upgraded) {
+	upgraded = false;
+
+	MappedFile file;
+	if (!file.open(path)) {
+		printf("Failed to open stat file for upgrade: %s\n", path.c_str());
+		return false;
+	}
+
+	StatCursor cursor = file.cursor();
+	StatFileHeader header;
+	if (!cursor.read(header)) {
+		printf("Failed to read stat file header: %s\n", path.c_str());
+		return false;
+	}
+
+	if (header.version == STAT_HISTORY_VERSION) {
+		return true;
+	}
+	if (header.version != STAT_FILE_VERSION) {
+		printf("Bad version %d in stat file: %s\n", header.version, path.c_str());
+		return false;
+	}
+
+	std::string tempPath = path + ".temp";
+	FILE* tempFile = fopen(tempPath.c_str(), "wb");
+	if (!tempFile) {
+		printf("Failed to create stat file: %s\n", tempPath.c_str());
+		return false;
+	}
+
+	bool success = writeStatHeader(tempFile, statFileMagicBytes, tempPath, STAT_HISTORY_VERSION);
+	fclose(tempFile);
+
+	StatBlockWriter writer;
+	success = success && writer.open(tempPath);
+
+	success = success && decodeStats<1>(cursor, [&](const StatRecord& rec) {
+		return writer.append(rec);
+	}) && cursor.eof() && writer.flush();
+
+	writer.close();
+	file.close();
+
+	if (!success) {
+		printf("Failed to upgrade stat file: %s\n", path.c_str());
+		remove(tempPath.c_str());
+		return false;
+	}
+
+	errno = 0;
+	if (!replaceFile(tempPath, path)) {
+		printf("Failed to replace stat file with its upgrade (error %d): %s\n", errno, path.c_str());
+		remove(tempPath.c_str());
+		return false;
+	}
+
+	upgraded = true;
+	return true;
+}
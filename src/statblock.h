@@ -0,0 +1,80 @@
+#pragma once
+#include "statfile.h"
+#include <string>
+#include <stdio.h>
+
+#pragma pack(push, 1)
+// the end of the stats in a v2 stat file
+struct StatPosition {
+	uint64_t blockOffset; // file offset of the last block (0 = no blocks yet)
+	uint16_t count; // stats in the last block
+};
+#pragma pack(pop)
+
+// Appends stats to a v2 stat history file. The header of the last block is rewritten when the
+// writer is flushed, so readers only see complete stats.
+struct StatBlockWriter {
+	StatBlockWriter() {}
+	~StatBlockWriter();
+	StatBlockWriter(const StatBlockWriter&) = delete;
+	StatBlockWriter& operator=(const StatBlockWriter&) = delete;
+
+	// opens an existing v2 stat file for appending
+	bool open(const std::string& path);
+	bool append(const StatSample& stat);
+
+	// writes the last block header and flushes the file
+	bool flush();
+	void close();
+
+	// closes the file without writing the last block header, so that stats appended since the
+	// last successful flush are left out of the file
+	void discard();
+
+	// time of the last stat in the file, or 0 if there are none
+	uint32_t lastTime() const { return lastStatTime; }
+
+	// number of appended stats that a successful flush has written since the file was opened
+	uint64_t savedStats() const { return numSaved; }
+
+	// end of the stats in the file
+	StatPosition position() const;
+
+	// counts the stats in the file after a position, using the block headers.
+	// False if the headers can't be read or the file no longer reaches the position.
+	bool countSince(const StatPosition& pos, uint64_t& count);
+
+private:
+	FILE* file = NULL;
+	std::string path;
+	size_t blockOffset = 0; // file offset of the last block (0 = no blocks yet)
+	size_t writePos = 0; // current file position, to avoid seeking between appends
+	StatBlockHeader block;
+	bool blockDirty = false;
+	uint32_t lastStatTime = 0;
+	uint64_t numSaved = 0;
+	uint16_t blockSaved = 0; // stats in the last block as of its last successful flush
+
+	bool writeAt(size_t offset, const void* data, size_t size);
+	bool startBlock(const StatSample& stat);
+};
+
+// time-weighted player count summary for a range of time
+struct StatSummary {
+	uint32_t startTime; // first time with a known player count
+	uint32_t endTime;
+	uint64_t playerSeconds; // player count integrated over startTime -> endTime
+	uint32_t count; // stats written within the range
+	uint8_t minPlayers;
+	uint8_t maxPlayers;
+};
+
+// summarizes a v2 stat file from startTime up to endTime. Block headers are used for blocks
+// entirely within the range, so only the blocks at the edges of the range are decoded.
+// Only the decode bench uses this. Averages and ranks sample the player count once a minute, and
+// time-weighted block sums differ from those samples wherever a stat isn't on a sample time. They
+// also need per-hour or per-sample detail that spans block boundaries, so they decode every stat.
+bool summarizeStats(const MappedFile& file, uint32_t startTime, uint32_t endTime, StatSummary& summary);
+
+// rewrites a v1 stat history file as v2. upgraded is set to false if the file was already v2.
+bool upgradeStatFile(const std::string& path, bool& upgraded);
@@ -0,0 +1,316 @@
+#pragma once
+#include "statfile.h"
+#include <stdio.h>
+
+// Shared decoding loops for stat and rank files. Each file version specializes StatFormat/RankFormat,
+// and consumers pass a visitor which is inlined into the decoding loop.
+
+struct StatRecord : StatSample {
+	const uint8_t* start; // raw bytes of the record
+	const uint8_t* end;
+};
+
+struct RankRecord {
+	uint32_t time;
+	uint16_t rank;
+};
+
+inline uint8_t getStatTimeFlags(uint8_t stat) {
+	if ((stat & PCNT_FL_MASK) == PCNT_UNREACHABLE) {
+		return (stat << 2) & PCNT_FL_MASK;
+	}
+	return stat & PCNT_FL_MASK;
+}
+
+inline int getStatTimeSize(uint8_t stat) {
+	uint8_t flags = getStatTimeFlags(stat);
+	if (flags & FL_PCNT_TIME32) {
+		return sizeof(uint32_t);
+	}
+	else if (flags & FL_PCNT_TIME16) {
+		return sizeof(uint16_t);
+	}
+	return sizeof(uint8_t);
+}
+
+template<int VERSION>
+struct StatFormat;
+
+template<int VERSION>
+struct RankFormat;
+
+// a flags/player count byte followed by an 8 or 16 bit time delta, or a 32 bit absolute time
+template<>
+struct StatFormat<1> {
+	// decodes the record at the cursor, relative to the previous record. False if truncated.
+	static inline bool read(StatCursor& cursor, StatRecord& rec) {
+		rec.start = cursor.pos;
+
+		uint8_t stat = *cursor.pos++;
+		uint8_t flags = stat & PCNT_FL_MASK;
+
+		if (flags == PCNT_UNREACHABLE) {
+			rec.players = 0;
+			rec.unreachable = true;
+			flags = (stat << 2) & PCNT_FL_MASK;
+			if (stat & 0x0f) {
+				printf("Invalid flags in unreachable byte %X\n", (int)stat);
+			}
+		}
+		else {
+			rec.players = stat & ~PCNT_FL_MASK;
+			rec.unreachable = false;
+		}
+
+		if (flags & FL_PCNT_TIME32) {
+			if (!cursor.read(rec.time)) {
+				return false;
+			}
+		}
+		else if (flags & FL_PCNT_TIME16) {
+			uint16_t delta;
+			if (!cursor.read(delta)) {
+				return false;
+			}
+			rec.time += delta;
+		}
+		else {
+			uint8_t delta;
+			if (!cursor.read(delta)) {
+				return false;
+			}
+			rec.time += delta;
+		}
+
+		rec.end = cursor.pos;
+		return true;
+	}
+};
+
+// A varint holding the time delta from the previous stat in the block (upper bits) and a 4-bit player code.
+// Small player count changes are stored in the code, otherwise the player count follows as another varint.
+template<>
+struct StatFormat<2> {
+	static inline bool read(StatCursor& cursor, StatRecord& rec) {
+		rec.start = cursor.pos;
+
+		uint32_t value;
+		const uint8_t* pos = cursor.pos;
+
+		if (cursor.end - pos >= 2 && (pos[0] & 0x80) && !(pos[1] & 0x80)) {
+			// most stats are a 2 byte varint
+			value = (pos[0] & 0x7f) | ((uint32_t)pos[1] << 7);
+			cursor.pos += 2;
+		}
+		else if (!cursor.readVarint(value)) {
+			return false;
+		}
+
+		rec.time += value >> STAT_CODE_BITS;
+		uint32_t code = value & STAT_CODE_MASK;
+
+		if (code == STAT_CODE_UNREACHABLE) {
+			rec.players = 0;
+			rec.unreachable = true;
+		}
+		else if (code == STAT_CODE_ABSOLUTE) {
+			uint32_t players;
+			if (!cursor.readVarint(players) || players > 255) {
+				return false;
+			}
+			rec.players = players;
+			rec.unreachable = false;
+		}
+		else {
+			// zigzag encoded change from the last player count
+			int players = (int)rec.players + ((code & 1) ? -(int)(code >> 1) - 1 : (int)(code >> 1));
+			if (players < 0 || players > 255) {
+				return false;
+			}
+			rec.players = players;
+			rec.unreachable = false;
+		}
+
+		rec.end = cursor.pos;
+		return true;
+	}
+};
+
+// a flags/rank delta byte, optionally followed by a 16 bit absolute rank, then a 16 bit time delta
+// or a 32 bit absolute time
+template<>
+struct RankFormat<1> {
+	static inline bool read(StatCursor& cursor, RankRecord& rec) {
+		uint8_t rankChange = *cursor.pos++;
+		uint8_t flags = rankChange & FL_RANK_MASK;
+		uint8_t rankDelta = rankChange & ~FL_RANK_MASK;
+
+		if (flags & FL_RANK_RANK16) {
+			if (rankDelta) {
+				printf("Invalid rank bits in 16bit delta\n");
+				return false;
+			}
+			if (!cursor.read(rec.rank)) {
+				printf("Failed to read rank\n");
+				return false;
+			}
+		}
+		else {
+			int8_t rankSigned = rankDelta;
+			if (rankDelta & RANK_SIGN_BIT) {
+				rankSigned |= FL_RANK_MASK; // sign extension to fit the int8
+			}
+			int newRank = (int)rec.rank + (int)rankSigned;
+			if (newRank < 0 || newRank > 65535) {
+				printf("Invalid new rank: %d\n", newRank);
+				return false;
+			}
+			rec.rank = newRank;
+		}
+
+		if (flags & FL_RANK_TIME32) {
+			if (!cursor.read(rec.time)) {
+				printf("Failed to read rank time\n");
+				return false;
+			}
+		}
+		else {
+			uint16_t delta;
+			if (!cursor.read(delta)) {
+				printf("Failed to read rank time delta\n");
+				return false;
+			}
+			rec.time += delta;
+		}
+
+		return true;
+	}
+};
+
+// Calls visitor(const StatRecord&) for each stat until the data ends or the visitor returns false.
+// startTime is the time of the stat before the cursor. Returns false if the data is truncated.
+template<int VERSION = STAT_FILE_VERSION, typename Visitor>
+inline bool decodeStats(StatCursor& cursor, Visitor&& visitor, uint32_t startTime = 0) {
+	StatRecord rec;
+	rec.time = startTime;
+
+	while (!cursor.eof()) {
+		if (!StatFormat<VERSION>::read(cursor, rec)) {
+			printf("Failed to read stat time\n");
+			return false;
+		}
+		if (!visitor(rec)) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Calls visitor(const StatRecord&) for each stat in a v2 stat file, starting from the block at the cursor.
+// Returns false if a block is invalid or truncated.
+template<typename Visitor>
+inline bool decodeStatBlocks(StatCursor& cursor, Visitor&& visitor) {
+	StatRecord rec;
+
+	while (!cursor.eof()) {
+		const uint8_t* blockStart = cursor.pos;
+		StatBlockHeader block;
+
+		if (!cursor.read(block) || block.size > STAT_BLOCK_SIZE - sizeof(StatBlockHeader)
+			|| (size_t)(cursor.end - cursor.pos) < block.size)
+		{
+			printf("Truncated stat block\n");
+			return false;
+		}
+
+		StatCursor records(cursor.pos, block.size);
+		rec.time = block.startTime;
+		rec.players = 0;
+
+		for (int i = 0; i < block.count; i++) {
+			if (!StatFormat<2>::read(records, rec)) {
+				printf("Invalid stat in block\n");
+				return false;
+			}
+			if (!visitor(rec)) {
+				cursor.pos = records.pos;
+				return true;
+			}
+		}
+
+		size_t remaining = cursor.end - blockStart;
+		cursor.pos = blockStart + (remaining < STAT_BLOCK_SIZE ? remaining : STAT_BLOCK_SIZE);
+	}
+
+	return true;
+}
+
+// decodes a stat history file of either version. The cursor must be at a stat for v1 files (with
+// startTime being the time of the stat before it) or at a block for v2 files.
+template<typename Visitor>
+inline bool decodeStatHistory(StatCursor& cursor, uint32_t version, Visitor&& visitor, uint32_t startTime = 0) {
+	if (version == STAT_HISTORY_VERSION) {
+		return decodeStatBlocks(cursor, visitor);
+	}
+	return decodeStats<1>(cursor, visitor, startTime);
+}
+
+inline int getStatBlockCount(const MappedFile& file) {
+	if (file.size <= sizeof(StatFileHeader)) {
+		return 0;
+	}
+	return (file.size - sizeof(StatFileHeader) + STAT_BLOCK_SIZE - 1) / STAT_BLOCK_SIZE;
+}
+
+inline size_t getStatBlockOffset(int block) {
+	return sizeof(StatFileHeader) + (size_t)block * STAT_BLOCK_SIZE;
+}
+
+// header of a v2 stat block. False if the block is truncated.
+inline bool readStatBlockHeader(const MappedFile& file, int block, StatBlockHeader& header) {
+	StatCursor cursor = file.cursor(getStatBlockOffset(block));
+	return cursor.read(header);
+}
+
+// offset of the last block in a v2 stat file that starts before the given time, or the first block if
+// there isn't one. Decoding from there gives the player count at that time.
+inline size_t findStatBlock(const MappedFile& file, uint32_t time) {
+	int low = 0;
+	int high = getStatBlockCount(file) - 1;
+	int best = 0;
+
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		StatBlockHeader header;
+
+		if (readStatBlockHeader(file, mid, header) && header.count && header.startTime < time) {
+			best = mid;
+			low = mid + 1;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+
+	return getStatBlockOffset(best);
+}
+
+// Calls visitor(const RankRecord&) for each rank change. Returns false if the data is invalid.
+template<int VERSION = STAT_FILE_VERSION, typename Visitor>
+inline bool decodeRanks(StatCursor& cursor, Visitor&& visitor) {
+	RankRecord rec;
+	rec.time = 0;
+	rec.rank = 0;
+
+	while (!cursor.eof()) {
+		if (!RankFormat<VERSION>::read(cursor, rec)) {
+			return false;
+		}
+		if (!visitor(rec)) {
+			break;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,120 @@
+#include "statfile.h"
+#include <stdio.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool StatCursor::readLongVarint(uint32_t& out) {
+	out = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (pos >= end) {
+			return false;
+		}
+		uint8_t b = *pos++;
+		out |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int writeVarint(uint32_t value, uint8_t* out) {
+	int len = 0;
+	while (value >= 0x80) {
+		out[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+	return len;
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	size = info.st_size;
+	if (size == 0) {
+		::close(fd);
+		return true;
+	}
+
+	void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // the mapping keeps its own reference to the file
+
+	if (view == MAP_FAILED) {
+		size = 0;
+		return false;
+	}
+
+	madvise(view, size, MADV_SEQUENTIAL);
+	data = (const uint8_t*)view;
+	mapped = true;
+	return true;
+#else
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	if (length <= 0) {
+		fclose(file);
+		return length == 0;
+	}
+
+	uint8_t* buffer = new uint8_t[length];
+	if (fread(buffer, length, 1, file) != 1) {
+		delete[] buffer;
+		fclose(file);
+		return false;
+	}
+	fclose(file);
+
+	data = buffer;
+	size = length;
+	return true;
+#endif
+}
+
+void MappedFile::close() {
+	if (!data) {
+		size = 0;
+		return;
+	}
+
+#ifndef _WIN32
+	if (mapped) {
+		munmap((void*)data, size);
+	}
+#else
+	delete[] data;
+#endif
+
+	data = NULL;
+	size = 0;
+	mapped = false;
+}
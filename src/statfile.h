@@ -0,0 +1,131 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include <string.h>
+
+#define STAT_FILE_VERSION 1 // delta format used by live/avg/rank files, and v1 stat history files
+#define STAT_HISTORY_VERSION 2 // block format for stat history files
+#define RTT_FILE_VERSION 1 // format of round trip time files
+
+#pragma pack(push, 1)
+struct StatFileHeader {
+	uint32_t version;
+	char magic[4]; // "SVTK" for stat files, "SVRK" for ranking files, or "SVRT" for round trip time files
+};
+
+#define FL_PCNT_TIME16 64		// time delta is 16 bits and relative to the last stat
+#define FL_PCNT_TIME32 128		// time is a 32 bit absoulte value
+#define PCNT_FL_MASK (FL_PCNT_TIME16|FL_PCNT_TIME32)
+#define PCNT_UNREACHABLE (PCNT_FL_MASK) // if both are set, the server is unreachable
+// if neither are set, time delta is 8-bits and relative to the last stat
+
+#define FL_RANK_RANK16 64		// ranking is not a delta and so does not fit in this byte
+#define FL_RANK_TIME32 128		// time delta is 32 bits instead of 16
+#define FL_RANK_MASK (FL_RANK_RANK16|FL_RANK_TIME32)
+#define RANK_SIGN_BIT 32		// bit containing the sign of the delta
+
+#define STAT_V1_MAX_PLAYERS 63	// player counts are stored in the low 6 bits of v1 stats
+
+// v2 stat history files are split into fixed-size blocks, so that blocks can be found by offset. Each block
+// starts with a summary of its stats, followed by varint encoded stats (see StatFormat<2>).
+// Only the last block in the file is shorter than STAT_BLOCK_SIZE.
+#define STAT_BLOCK_SIZE 4096
+
+#define FL_BLOCK_LAST_UNREACHABLE 1 // the last stat in the block is an unreachable stat
+
+#define STAT_CODE_BITS 4
+#define STAT_CODE_MASK ((1 << STAT_CODE_BITS) - 1)
+#define STAT_CODE_MAX_DELTA 13 // highest zigzag encoded player count change that fits in the code
+#define STAT_CODE_UNREACHABLE 14
+#define STAT_CODE_ABSOLUTE 15 // player count follows as a varint
+
+struct StatBlockHeader {
+	uint32_t startTime; // time of the first stat in the block
+	uint32_t endTime; // time of the last stat in the block
+	uint64_t playerSeconds; // player count integrated over startTime -> endTime
+	uint16_t count; // number of stats in the block
+	uint16_t size; // bytes of encoded stats following the header
+	uint8_t minPlayers;
+	uint8_t maxPlayers;
+	uint8_t lastPlayers; // player count of the last stat, which holds until the next block starts
+	uint8_t flags;
+};
+
+#pragma pack(pop)
+
+// a decoded player count stat
+struct StatSample {
+	uint32_t time;
+	uint8_t players;
+	bool unreachable;
+};
+
+// LEB128 encodes a value (up to 5 bytes). Returns the number of bytes written.
+int writeVarint(uint32_t value, uint8_t* out);
+
+// bounds-checked reader for a span of stat file bytes
+struct StatCursor {
+	const uint8_t* start;
+	const uint8_t* pos;
+	const uint8_t* end;
+
+	StatCursor() : start(NULL), pos(NULL), end(NULL) {}
+	StatCursor(const uint8_t* data, size_t size, size_t offset = 0) : start(data), pos(data + offset), end(data + size) {}
+
+	// false if there aren't enough bytes left
+	template<typename T>
+	inline bool read(T& out) {
+		if ((size_t)(end - pos) < sizeof(T)) {
+			return false;
+		}
+		memcpy(&out, pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	// LEB128 encoded integer. False if truncated or too large.
+	inline bool readVarint(uint32_t& out) {
+		if (end - pos >= 2 && !(pos[1] & 0x80)) {
+			// 1 or 2 bytes, which covers most values
+			if (!(pos[0] & 0x80)) {
+				out = *pos++;
+				return true;
+			}
+			out = (pos[0] & 0x7f) | ((uint32_t)pos[1] << 7);
+			pos += 2;
+			return true;
+		}
+		return readLongVarint(out);
+	}
+
+	bool readLongVarint(uint32_t& out);
+
+	inline bool eof() const {
+		return pos >= end;
+	}
+
+	inline size_t tell() const {
+		return pos - start;
+	}
+};
+
+// read-only view of an entire file. Memory mapped where supported, otherwise read into a buffer.
+struct MappedFile {
+	const uint8_t* data = NULL;
+	size_t size = 0;
+
+	MappedFile() {}
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+
+	StatCursor cursor(size_t offset = 0) const {
+		return StatCursor(data, size, offset);
+	}
+
+private:
+	bool mapped = false;
+};
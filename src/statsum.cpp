@@ -0,0 +1,366 @@
+#include "statsum.h"
+#include <algorithm>
+#include <stdio.h>
+
+void SampleWindow::init(const uint32_t* lengths, int numWindows, uint32_t interval) {
+	grid = SampleGrid(0, interval);
+	spans.resize(numWindows);
+	for (int i = 0; i < numWindows; i++) {
+		spans[i].numSamples = lengths[i] / interval;
+		spans[i].firstSample = 0;
+		spans[i].sum = 0;
+	}
+	endSample = 0;
+	runs.clear();
+}
+
+void SampleWindow::add(uint32_t time, uint8_t players) {
+	advance(time);
+
+	// a later stat in the same interval replaces the count for the next sample
+	if (!runs.empty() && runs.back().start >= endSample) {
+		runs.back().players = players;
+		if (runs.size() > 1 && runs[runs.size() - 2].players == players) {
+			runs.pop_back();
+		}
+	}
+	else if (runs.empty() || runs.back().players != players) {
+		Run run;
+		run.start = endSample;
+		run.players = players;
+		runs.push_back(run);
+	}
+}
+
+uint64_t SampleWindow::sumRuns(uint32_t first, uint32_t last) const {
+	// last run starting at or before the first sample
+	auto it = std::upper_bound(runs.begin(), runs.end(), first, [](uint32_t sample, const Run& run) {
+		return sample < run.start;
+	});
+	if (it != runs.begin()) {
+		it--;
+	}
+
+	uint64_t sum = 0;
+	for (; it != runs.end() && it->start < last; it++) {
+		auto next = it + 1;
+		uint32_t begin = it->start > first ? it->start : first;
+		uint32_t end = next != runs.end() && next->start < last ? next->start : last;
+		if (end > begin) {
+			sum += (uint64_t)it->players * (end - begin);
+		}
+	}
+
+	return sum;
+}
+
+void SampleWindow::advance(uint32_t time) {
+	uint32_t newEnd = grid.countUpTo(time);
+	if (newEnd <= endSample) {
+		return;
+	}
+
+	uint32_t oldestSample = newEnd;
+
+	for (Span& span : spans) {
+		uint32_t newFirst = newEnd > span.numSamples ? newEnd - span.numSamples : 0;
+
+		// subtract samples that left the window
+		uint32_t leaveEnd = newFirst < endSample ? newFirst : endSample;
+		if (leaveEnd > span.firstSample) {
+			span.sum -= sumRuns(span.firstSample, leaveEnd);
+		}
+
+		// new samples all take the latest player count
+		uint32_t enterStart = endSample > newFirst ? endSample : newFirst;
+		if (!runs.empty()) {
+			span.sum += (uint64_t)runs.back().players * (newEnd - enterStart);
+		}
+
+		span.firstSample = newFirst;
+		oldestSample = newFirst < oldestSample ? newFirst : oldestSample;
+	}
+
+	endSample = newEnd;
+
+	while (runs.size() > 1 && runs[1].start <= oldestSample) {
+		runs.pop_front();
+	}
+}
+
+void HourlyRollups::init(uint32_t length, uint32_t interval) {
+	grid = SampleGrid(0, interval);
+	numHours = length / 3600;
+	endSample = 0;
+	started = false;
+	players = 0;
+	unreachable = false;
+	hours.clear();
+}
+
+void HourlyRollups::add(uint32_t time, uint8_t newPlayers, bool newUnreachable) {
+	advance(time);
+	started = true;
+	players = newPlayers;
+	unreachable = newUnreachable;
+}
+
+void HourlyRollups::advance(uint32_t time) {
+	uint32_t newEnd = grid.countUpTo(time);
+	if (newEnd <= endSample) {
+		return;
+	}
+
+	uint32_t lastHour = (uint64_t)(newEnd - 1) * grid.interval / 3600;
+	uint32_t firstHour = lastHour > numHours ? lastHour - numHours : 0;
+
+	if (!started) {
+		endSample = newEnd;
+		return;
+	}
+
+	// skip samples in hours that would be dropped anyway
+	uint32_t firstSample = grid.countBefore(firstHour * 3600);
+	if (endSample < firstSample) {
+		hours.clear();
+		endSample = firstSample;
+	}
+
+	while (endSample < newEnd) {
+		uint32_t hour = (uint64_t)endSample * grid.interval / 3600;
+		uint32_t hourEnd = grid.countBefore((hour + 1) * 3600);
+		uint32_t end = hourEnd < newEnd ? hourEnd : newEnd;
+		uint32_t count = end - endSample;
+
+		if (hours.empty() || hours.back().hour != hour) {
+			HourRollup rollup;
+			rollup.hour = hour;
+			rollup.sum = 0;
+			rollup.peak = 0;
+			rollup.unreachable = 0;
+			hours.push_back(rollup);
+		}
+
+		HourRollup& rollup = hours.back();
+		rollup.sum += players * count;
+		rollup.peak = players > rollup.peak ? players : rollup.peak;
+		if (unreachable) {
+			rollup.unreachable += count;
+		}
+
+		endSample = end;
+	}
+
+	while (!hours.empty() && hours.front().hour < firstHour) {
+		hours.pop_front();
+	}
+}
+
+// last stat before the given time, or NULL if there isn't one
+const StatSample* getTestSampleStat(const std::vector<StatSample>& stats, uint32_t time) {
+	auto it = std::lower_bound(stats.begin(), stats.end(), time, [](const StatSample& stat, uint32_t t) {
+		return stat.time < t;
+	});
+	return it != stats.begin() ? &*(it - 1) : NULL;
+}
+
+// sum of samples [first, last) where each sample takes the player count of the last stat before its time
+uint64_t sumTestSamples(const std::vector<StatSample>& stats, uint32_t interval, uint32_t first, uint32_t last) {
+	uint64_t sum = 0;
+
+	for (uint32_t sample = first; sample < last; sample++) {
+		const StatSample* stat = getTestSampleStat(stats, sample * interval);
+		sum += stat ? stat->players : 0;
+	}
+
+	return sum;
+}
+
+// checks the window sums after stats were added up to the given time. Returns the number of wrong sums.
+int checkTestWindows(const SampleWindow& window, const SampleWindow* single, const uint32_t* lengths, int numWindows,
+	const std::vector<StatSample>& stats, uint32_t interval, uint32_t time)
+{
+	SampleGrid grid(0, interval);
+	uint32_t end = grid.countUpTo(time);
+	int wrong = 0;
+
+	for (int i = 0; i < numWindows; i++) {
+		uint32_t numSamples = lengths[i] / interval;
+		uint32_t first = end > numSamples ? end - numSamples : 0;
+		uint64_t expected = sumTestSamples(stats, interval, first, end);
+
+		// windows sharing one list of runs must sum the same as a window that has the runs to itself
+		if (window.sum(i) != expected || single[i].sum(0) != expected) {
+			wrong++;
+		}
+	}
+
+	return wrong;
+}
+
+// checks every hour that may have a rollup after stats were added up to the given time.
+// Returns the number of wrong rollups.
+int checkTestRollups(const HourlyRollups& rollups, uint32_t numHours, const std::vector<StatSample>& stats,
+	uint32_t interval, uint32_t time)
+{
+	SampleGrid grid(0, interval);
+	uint32_t firstSample = grid.countUpTo(stats[0].time); // samples up to the first stat aren't rolled up
+	uint32_t endSample = grid.countUpTo(time);
+	uint32_t lastHour = (endSample - 1) * interval / 3600;
+	uint32_t firstHour = lastHour > numHours ? lastHour - numHours : 0;
+	int wrong = 0;
+
+	for (uint32_t hour = firstHour > 2 ? firstHour - 2 : 0; hour <= lastHour + 1; hour++) {
+		uint32_t first = std::max(firstSample, grid.countBefore(hour * 3600));
+		uint32_t last = std::min(endSample, grid.countBefore((hour + 1) * 3600));
+		const HourRollup* rollup = rollups.get(hour);
+
+		if (hour < firstHour || first >= last) {
+			wrong += rollup ? 1 : 0;
+			continue;
+		}
+
+		HourRollup expected = { hour, 0, 0, 0 };
+		for (uint32_t sample = first; sample < last; sample++) {
+			const StatSample* stat = getTestSampleStat(stats, sample * interval);
+			expected.sum += stat->players;
+			expected.peak = std::max(expected.peak, stat->players);
+			expected.unreachable += stat->unreachable ? 1 : 0;
+		}
+
+		if (!rollup || rollup->hour != hour || rollup->sum != expected.sum || rollup->peak != expected.peak
+			|| rollup->unreachable != expected.unreachable) {
+			wrong++;
+		}
+	}
+
+	return wrong;
+}
+
+int statsum_test() {
+	const uint32_t interval = 60;
+	const uint32_t lengths[] = { 5 * 60, 60 * 60, 6 * 60 * 60 };
+	const int numWindows = sizeof(lengths) / sizeof(uint32_t);
+	int failures = 0;
+
+	SampleWindow window;
+	SampleWindow single[numWindows];
+	window.init(lengths, numWindows, interval);
+	for (int i = 0; i < numWindows; i++) {
+		single[i].init(&lengths[i], 1, interval);
+	}
+
+	// Stats arrive 10 seconds to 7 minutes apart, sometimes in the same interval as the last one or exactly on
+	// a sample time. Gaps of 2 hours and 8 hours are longer than some or all of the windows.
+	std::vector<StatSample> stats;
+	uint32_t time = 1000000 * interval + 7;
+	uint32_t seed = 54321;
+	int evictionErrors = 0;
+	int gapErrors = 0;
+
+	for (int i = 0; i < 600; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+
+		bool gap = i == 200 || i == 400;
+		uint32_t gapLength = i == 200 ? 2 * 60 * 60 : 8 * 60 * 60;
+		time += gap ? gapLength : r % 4 == 0 ? interval - time % interval : 10 + r % 410;
+
+		if (gap) {
+			// during the gap, the windows slide forward over samples that take the last player count
+			for (uint32_t t = time - gapLength + interval; t < time; t += 17 * interval) {
+				window.advance(t);
+				for (int k = 0; k < numWindows; k++) {
+					single[k].advance(t);
+				}
+				gapErrors += checkTestWindows(window, single, lengths, numWindows, stats, interval, t);
+			}
+		}
+
+		StatSample stat;
+		stat.time = time;
+		stat.players = r % 5 == 0 ? 0 : r % 40;
+		stat.unreachable = false;
+		stats.push_back(stat);
+
+		window.add(stat.time, stat.players);
+		for (int k = 0; k < numWindows; k++) {
+			single[k].add(stat.time, stat.players);
+		}
+
+		int errors = checkTestWindows(window, single, lengths, numWindows, stats, interval, stat.time);
+		if (gap) {
+			gapErrors += errors;
+		}
+		else {
+			evictionErrors += errors;
+		}
+	}
+
+	if (evictionErrors) {
+		printf("FAIL: %d sample window sums were wrong as samples left the windows\n", evictionErrors);
+		failures++;
+	}
+	else {
+		printf("PASS: sample window sums match every sample in %d windows sharing one list of runs\n", numWindows);
+	}
+
+	if (gapErrors) {
+		printf("FAIL: %d sample window sums were wrong during or after a gap longer than a window\n", gapErrors);
+		failures++;
+	}
+	else {
+		printf("PASS: sample window sums are right during and after gaps longer than the windows\n");
+	}
+
+	// Stats on, just before and just after hour boundaries, with a gap longer than the rollups are kept
+	const uint32_t rollupLength = 6 * 60 * 60;
+	HourlyRollups rollups;
+	rollups.init(rollupLength, interval);
+	stats.clear();
+	time = 500000 * 3600 + 1234;
+	int rollupErrors = 0;
+
+	for (int i = 0; i < 400; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+
+		uint32_t nextHour = (time / 3600 + 1) * 3600;
+		if (i == 200) {
+			time += 9 * 60 * 60 + r % 3600;
+		}
+		else if (r % 6 == 0) {
+			time = nextHour - (r % 3 == 0 && nextHour - 1 > time ? 1 : 0);
+		}
+		else if (r % 6 == 1 && nextHour + 1 - time < 3600) {
+			time = nextHour + 1;
+		}
+		else {
+			time += 10 + r % 900;
+		}
+
+		StatSample stat;
+		stat.time = time;
+		stat.unreachable = r % 10 == 0;
+		stat.players = stat.unreachable ? 0 : r % 33;
+		stats.push_back(stat);
+
+		rollups.add(stat.time, stat.players, stat.unreachable);
+		rollupErrors += checkTestRollups(rollups, rollupLength / 3600, stats, interval, stat.time);
+
+		// hours also fill up as time passes without new stats
+		time += r % 7 == 0 ? r % 7200 : 0;
+		rollups.advance(time);
+		rollupErrors += checkTestRollups(rollups, rollupLength / 3600, stats, interval, time);
+	}
+
+	if (rollupErrors) {
+		printf("FAIL: %d hourly rollups were wrong\n", rollupErrors);
+		failures++;
+	}
+	else {
+		printf("PASS: hourly rollups match the samples in each hour, across hour boundaries and gaps\n");
+	}
+
+	return failures ? 1 : 0;
+}
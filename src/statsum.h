@@ -0,0 +1,132 @@
+#pragma once
+#include "statfile.h"
+#include <deque>
+#include <vector>
+
+// Closed-form sums of player counts sampled at evenly spaced times. Ranks and averaged stats sample
+// the player count once per RANK_STAT_INTERVAL. Instead of visiting every sample, each stat adds
+// (player count * samples it covers), so long gaps between stats cost nothing.
+
+struct SampleGrid {
+	uint32_t start; // time of the first sample
+	uint32_t interval; // seconds between samples
+
+	SampleGrid(uint32_t start, uint32_t interval) : start(start), interval(interval) {}
+
+	// number of samples at times before t
+	uint32_t countBefore(uint32_t t) const {
+		return t <= start ? 0 : (t - start - 1) / interval + 1;
+	}
+
+	// number of samples at times up to and including t
+	uint32_t countUpTo(uint32_t t) const {
+		return t < start ? 0 : (t - start) / interval + 1;
+	}
+};
+
+// Sums of the samples in windows of different lengths that end at the current time and slide forward
+// with it. Samples are at whole multiples of the interval and take the player count from before their
+// time, so the sums are the same no matter when the windows are advanced. Stats are added as they're
+// written instead of re-reading stat files, and runs of equal samples are kept so that samples leaving
+// a window can be subtracted.
+struct SampleWindow {
+	// clears the windows. Lengths must be multiples of the interval.
+	void init(const uint32_t* lengths, int numWindows, uint32_t interval);
+
+	// samples up to and including the given time take the current player count, which then changes
+	void add(uint32_t time, uint8_t players);
+
+	// slides the windows forward so that they end at the given time
+	void advance(uint32_t time);
+
+	// sum of the samples in a window
+	uint64_t sum(int window) const {
+		return spans[window].sum;
+	}
+
+private:
+#pragma pack(push, 1)
+	struct Run {
+		uint32_t start; // first sample with this player count
+		uint8_t players;
+	};
+#pragma pack(pop)
+
+	struct Span {
+		uint32_t numSamples; // samples in the window
+		uint32_t firstSample; // first sample in the window
+		uint64_t sum;
+	};
+
+	SampleGrid grid = SampleGrid(0, 1);
+	std::vector<Span> spans;
+	uint32_t endSample = 0; // samples before this are in the windows or expired
+	std::deque<Run> runs; // player counts for the samples in the longest window, and any later samples
+
+	// sum of samples [first, last), which must not be before the first run
+	uint64_t sumRuns(uint32_t first, uint32_t last) const;
+};
+
+// Totals of the samples in each hour, so that ranking formulas can tell when players were online
+// without visiting every sample. Samples are taken the same way as in SampleWindow.
+#pragma pack(push, 1)
+struct HourRollup {
+	uint32_t hour; // hours since the epoch
+	uint32_t sum; // sum of the player counts sampled in the hour
+	uint8_t peak; // highest player count sampled in the hour
+	uint16_t unreachable; // samples taken while the server was unreachable
+};
+#pragma pack(pop)
+
+struct HourlyRollups {
+	std::deque<HourRollup> hours; // oldest first. There's a rollup for every hour since the first stat.
+
+	// clears the rollups. Hours that ended more than length seconds ago are dropped.
+	void init(uint32_t length, uint32_t interval);
+
+	// samples up to and including the given time take the current state, which then changes
+	void add(uint32_t time, uint8_t players, bool unreachable);
+
+	// adds the samples up to the given time
+	void advance(uint32_t time);
+
+	// rollup for the given hour, or NULL if there were no samples in it
+	const HourRollup* get(uint32_t hour) const {
+		if (hours.empty() || hour < hours.front().hour || hour > hours.back().hour) {
+			return NULL;
+		}
+		return &hours[hour - hours.front().hour];
+	}
+
+private:
+	SampleGrid grid = SampleGrid(0, 1);
+	uint32_t numHours = 0; // hours kept before the current one
+	uint32_t endSample = 0; // samples before this were added
+	bool started = false; // false until the first stat is added
+	uint8_t players = 0;
+	bool unreachable = false;
+};
+
+// Sums samples [first, last) where each sample takes the player count of the last stat at or before
+// its time. Stats must be in time order. Samples before the first stat count as 0.
+template<typename Stats>
+uint64_t sumSamples(const SampleGrid& grid, const Stats& stats, uint32_t first, uint32_t last) {
+	uint64_t sum = 0;
+
+	for (auto it = stats.begin(); it != stats.end(); it++) {
+		auto next = it + 1;
+		uint32_t begin = grid.countBefore(it->time);
+		uint32_t end = next != stats.end() ? grid.countBefore(next->time) : last;
+		begin = begin > first ? begin : first;
+		end = end < last ? end : last;
+
+		if (end > begin) {
+			sum += (uint64_t)it->players * (end - begin);
+		}
+	}
+
+	return sum;
+}
+
+// checks the sample windows and hourly rollups against sums of every sample. Returns 0 if it passed.
+int statsum_test();
@@ -168,10 +168,30 @@ uint64_t getEpochMillis() {
 	return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 }
 
+uint64_t getEpochMicros() {
+	return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
 uint32_t getEpochSeconds() {
 	return duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
 }
 
+uint64_t getThreadCpuMicros() {
+#if defined(WIN32) || defined(_WIN32)
+	FILETIME createTime, exitTime, kernelTime, userTime;
+	if (!GetThreadTimes(GetCurrentThread(), &createTime, &exitTime, &kernelTime, &userTime)) {
+		return 0;
+	}
+	uint64_t kernel = ((uint64_t)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+	uint64_t user = ((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+	return (kernel + user) / 10; // 100ns units
+#else
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
 void winPath(string& path)
 {
 	for (int i = 0, size = path.size(); i < size; i++)
@@ -246,6 +266,23 @@ vector<string> getDirFiles(string path, string extension, string startswith)
 	return results;
 }
 
+bool truncateFile(FILE* file, uint64_t size) {
+	fflush(file);
+#if defined(_WIN32)
+	return _chsize_s(_fileno(file), size) == 0;
+#else
+	return ftruncate(fileno(file), size) == 0;
+#endif
+}
+
+bool replaceFile(const string& src, const string& dst) {
+#if defined(_WIN32)
+	return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(src.c_str(), dst.c_str()) == 0;
+#endif
+}
+
 bool dirExists(const string& path)
 {
 	struct stat info;
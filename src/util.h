@@ -15,6 +15,12 @@ string replaceString(string subject, string search, string replace);
 
 bool fileExists(string path);
 
+// sets the size of an open file
+bool truncateFile(FILE* file, uint64_t size);
+
+// moves src to dst, replacing dst in a single step if it exists
+bool replaceFile(const string& src, const string& dst);
+
 char* loadFile(const string& fileName, int& length);
 
 string stringifyJson(Value& v);
@@ -23,8 +29,13 @@ bool writeJson(string path, Value& jsonVal);
 
 uint64_t getEpochMillis();
 
+uint64_t getEpochMicros();
+
 uint32_t getEpochSeconds();
 
+// CPU time used by the calling thread
+uint64_t getThreadCpuMicros();
+
 vector<string> getDirFiles(string path, string extension, string startswith);
 
 bool dirExists(const string& path);
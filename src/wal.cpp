@@ -0,0 +1,736 @@
+#include "wal.h"
+#include "main.h"
+#include "util.h"
+#include "statdecode.h"
+#include "statblock.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+
+#define WAL_SEGMENT_TIME (60*10) // seconds of stats written to a segment before it's compacted
+#define WAL_FILE_VERSION 2
+
+#pragma pack(push, 1)
+struct WalBlockHeader {
+	uint32_t time; // time the block was written
+	uint32_t size; // bytes of stat entries that follow
+};
+
+struct WalStatEntry {
+	uint32_t time;
+	uint8_t players;
+	uint8_t unreachable;
+};
+#pragma pack(pop)
+
+// a block entry is a length-prefixed server id followed by a WalStatEntry. Version 1 segments have
+// v1 stat bytes instead, which are relative to the previous stat in the server's stat file.
+
+// While a segment is folded, a progress file next to it gets a length-prefixed server id and a StatPosition
+// for each server, before the server's stats are appended to its stat file. If the program stops before the
+// segment is deleted, the stats after that position are the ones that were already folded.
+
+const char* walFileMagicBytes = "SVWL";
+const char* walProgressMagicBytes = "SVWP";
+
+FILE* g_walFile = NULL; // segment being appended to
+string g_walSegmentPath;
+uint32_t g_walSegmentStartTime = 0;
+bool g_walSegmentEmpty = true;
+std::atomic<uint32_t> g_walSegmentId(0); // segments with a lower ID are ready to be compacted
+
+vector<uint8_t> g_walBlock; // stats for the current tick
+
+std::mutex g_walMutex; // held while segments are being folded into stat files
+std::condition_variable g_walSignal;
+std::thread g_walThread;
+bool g_walCompactPending = false;
+bool g_walStopping = false;
+
+// live/avg file state for servers updated by the compactor, independent of g_servers
+unordered_map<string, ServerState> g_walLiveStates;
+
+string getWalPath() {
+	return dataStatsPath + "wal/";
+}
+
+string getWalSegmentPath(uint32_t id) {
+	char fname[32];
+	snprintf(fname, sizeof(fname), "%08u.wal", id);
+	return getWalPath() + fname;
+}
+
+string getWalProgressPath(const string& segmentPath) {
+	return segmentPath + ".progress";
+}
+
+// loads the stat file positions recorded while a segment was folded before.
+// Returns false if the file doesn't exist or has to be rewritten before more positions are appended.
+bool loadFoldProgress(const string& path, unordered_map<string, StatPosition>& progress) {
+	MappedFile file;
+	if (!fileExists(path) || !file.open(path)) {
+		return false;
+	}
+
+	StatCursor cursor = file.cursor();
+	StatFileHeader header;
+	if (!cursor.read(header) || strncmp(header.magic, walProgressMagicBytes, 4)) {
+		printf("Bad header in WAL progress file: %s\n", path.c_str());
+		return false;
+	}
+
+	while (!cursor.eof()) {
+		uint8_t idLen = 0;
+		StatPosition pos;
+
+		if (!cursor.read(idLen) || (size_t)(cursor.end - cursor.pos) < idLen + sizeof(StatPosition)) {
+			return false; // the program was stopped while writing the record, before the stats were appended
+		}
+
+		string serverId((const char*)cursor.pos, idLen);
+		cursor.pos += idLen;
+		cursor.read(pos);
+
+		// the first position is from before any of the server's stats were folded
+		progress.emplace(serverId, pos);
+	}
+
+	return true;
+}
+
+// records where a server's stats will be appended. Returns false if that failed.
+bool writeFoldProgress(FILE* file, const string& serverId, const StatPosition& pos) {
+	uint8_t idLen = serverId.size();
+	return file && fwrite(&idLen, 1, 1, file) && fwrite(serverId.c_str(), idLen, 1, file)
+		&& fwrite(&pos, sizeof(StatPosition), 1, file) && !fflush(file);
+}
+
+vector<uint32_t> getWalSegmentIds() {
+	vector<string> files = getDirFiles(getWalPath(), "wal", "");
+	vector<uint32_t> ids;
+
+	for (string& fname : files) {
+		ids.push_back(strtoul(fname.c_str(), NULL, 10));
+	}
+
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+// appends a server's stats from a segment to its stat file and live/avg files
+void foldServerStats(const string& serverId, vector<uint8_t>& entries, uint32_t version, uint32_t blockTime,
+	const unordered_map<string, StatPosition>& progress, FILE* progressFile)
+{
+	ServerState tempState;
+	tempState.init();
+	tempState.addr = serverId;
+
+	string fpath = tempState.getStatFilePath();
+	if (!fileExists(fpath)) {
+		printf("WAL stats dropped for missing stat file: %s\n", fpath.c_str());
+		return;
+	}
+
+	StatBlockWriter writer;
+	if (!openStatWriter(tempState, writer)) {
+		printf("Failed to open stat file for WAL stats: %s\n", fpath.c_str());
+		return;
+	}
+
+	// Stats that are in the stat file after the recorded position were folded before the program stopped,
+	// but the segment wasn't deleted yet. Replaying them again would append duplicates.
+	uint64_t numFolded = 0;
+	auto folded = progress.find(serverId);
+	if (folded != progress.end()) {
+		if (!writer.countSince(folded->second, numFolded)) {
+			printf("WAL stats dropped for stat file that changed since they were folded: %s\n", fpath.c_str());
+			return;
+		}
+	}
+	else if (!writeFoldProgress(progressFile, serverId, writer.position())) {
+		printf("Failed to record WAL progress. Stats may be folded again after a restart: %s\n", fpath.c_str());
+	}
+
+	vector<StatSample> stats;
+	StatCursor cursor(&entries[0], entries.size());
+
+	if (version == WAL_FILE_VERSION) {
+		WalStatEntry entry;
+		while (cursor.read(entry)) {
+			StatSample stat;
+			stat.time = entry.time;
+			stat.players = entry.players;
+			stat.unreachable = entry.unreachable;
+			stats.push_back(stat);
+		}
+	}
+	else {
+		decodeStats<1>(cursor, [&](const StatRecord& rec) {
+			stats.push_back(rec);
+			return true;
+		}, writer.lastTime());
+	}
+
+	stats.erase(stats.begin(), stats.begin() + std::min((size_t)numFolded, stats.size()));
+	if (stats.empty()) {
+		return;
+	}
+
+	bool written = true;
+	for (StatSample& stat : stats) {
+		written = written && writer.append(stat);
+	}
+
+	if (!written || !writer.flush()) {
+		printf("Failed to write WAL stats: %s\n", fpath.c_str());
+		return;
+	}
+	writer.close();
+
+	auto item = g_walLiveStates.find(serverId);
+	if (item == g_walLiveStates.end() || !item->second.liveFilesValid) {
+		g_walLiveStates[serverId] = tempState;
+		writeLiveStatFiles(g_walLiveStates[serverId], blockTime);
+		return;
+	}
+
+	ServerState& state = item->second;
+	vector<uint8_t> liveData;
+	vector<uint8_t> avgData;
+	bool needsTrim = false;
+
+	for (StatSample& stat : stats) {
+		uint8_t statBytes[5];
+		int statLen = encodeStat(state.lastWriteTime, stat, statBytes);
+
+		bool trim = false;
+		if (!encodeLiveStats(state, statBytes, statLen, stat.time, liveData, avgData, trim)) {
+			writeLiveStatFiles(state, blockTime);
+			return;
+		}
+		needsTrim = needsTrim || trim;
+		state.lastWriteTime = stat.time;
+	}
+
+	string livePath = state.getLiveStatFilePath();
+	string avgPath = state.getLiveAvgStatFilePath();
+	FILE* liveFile = fopen(livePath.c_str(), "ab");
+	FILE* avgFile = fopen(avgPath.c_str(), "ab");
+	bool success = liveFile && avgFile;
+
+	if (success && liveData.size()) {
+		success = fwrite(&liveData[0], liveData.size(), 1, liveFile) == 1;
+	}
+	if (success && avgData.size()) {
+		success = fwrite(&avgData[0], avgData.size(), 1, avgFile) == 1;
+	}
+	if (liveFile) {
+		fclose(liveFile);
+	}
+	if (avgFile) {
+		fclose(avgFile);
+	}
+
+	if (!success) {
+		printf("Failed to append live/avg WAL stats: %s\n", serverId.c_str());
+		writeLiveStatFiles(state, blockTime);
+	}
+	else if (needsTrim) {
+		trimLiveStatFile(state, state.lastWriteTime);
+	}
+}
+
+// mutex must be locked
+bool foldSegment(const string& path) {
+	MappedFile file;
+	if (!file.open(path)) {
+		printf("Failed to load WAL segment: %s\n", path.c_str());
+		return false;
+	}
+
+	StatCursor cursor = file.cursor();
+	StatFileHeader header;
+
+	bool validHeader = cursor.read(header) && !strncmp(header.magic, walFileMagicBytes, 4)
+		&& (header.version == WAL_FILE_VERSION || header.version == 1);
+
+	if (!validHeader) {
+		printf("Bad header in WAL segment: %s\n", path.c_str());
+		return false;
+	}
+
+	// server id -> stat entries, in the order they were written
+	unordered_map<string, vector<uint8_t>> serverStats;
+	unordered_map<string, uint32_t> lastBlockTimes;
+
+	while (!cursor.eof()) {
+		WalBlockHeader block;
+		if (!cursor.read(block) || (size_t)(cursor.end - cursor.pos) < block.size) {
+			// the program was stopped while writing the block
+			printf("Ignored truncated block in WAL segment: %s\n", path.c_str());
+			break;
+		}
+
+		StatCursor entries(cursor.pos, block.size);
+		cursor.pos += block.size;
+
+		while (!entries.eof()) {
+			uint8_t idLen = 0;
+			entries.read(idLen);
+
+			if ((size_t)(entries.end - entries.pos) < idLen + 1u) {
+				printf("Invalid entry in WAL segment: %s\n", path.c_str());
+				break;
+			}
+
+			string serverId((const char*)entries.pos, idLen);
+			entries.pos += idLen;
+
+			int statLen = sizeof(WalStatEntry);
+			if (header.version == 1) {
+				statLen = 1 + getStatTimeSize(entries.pos[0]);
+			}
+			if (entries.end - entries.pos < statLen) {
+				printf("Invalid entry in WAL segment: %s\n", path.c_str());
+				break;
+			}
+
+			vector<uint8_t>& stats = serverStats[serverId];
+			stats.insert(stats.end(), entries.pos, entries.pos + statLen);
+			lastBlockTimes[serverId] = block.time;
+			entries.pos += statLen;
+		}
+	}
+
+	file.close();
+
+	string progressPath = getWalProgressPath(path);
+	unordered_map<string, StatPosition> progress;
+
+	bool appendProgress = loadFoldProgress(progressPath, progress);
+
+	FILE* progressFile = fopen(progressPath.c_str(), appendProgress ? "ab" : "wb");
+	if (progressFile && !appendProgress) {
+		bool written = writeStatHeader(progressFile, walProgressMagicBytes, progressPath, WAL_FILE_VERSION);
+		for (auto& item : progress) {
+			written = written && writeFoldProgress(progressFile, item.first, item.second);
+		}
+
+		if (!written) {
+			fclose(progressFile);
+			progressFile = NULL;
+		}
+	}
+
+	for (auto& item : serverStats) {
+		foldServerStats(item.first, item.second, header.version, lastBlockTimes[item.first], progress, progressFile);
+	}
+
+	if (progressFile) {
+		fclose(progressFile);
+	}
+
+	return true;
+}
+
+// folds segments up to and including lastId. Mutex must be locked.
+void foldClosedSegments(uint32_t lastId) {
+	vector<uint32_t> ids = getWalSegmentIds();
+	uint64_t startTime = getEpochMillis();
+	int numFolded = 0;
+
+	for (uint32_t id : ids) {
+		if (id > lastId) {
+			break; // still being written
+		}
+
+		string path = getWalSegmentPath(id);
+		if (foldSegment(path)) {
+			numFolded++;
+		}
+		else {
+			// keep the file around for inspection, but don't try to replay it again
+			rename(path.c_str(), (path + ".bad").c_str());
+			remove(getWalProgressPath(path).c_str());
+			continue;
+		}
+
+		remove(path.c_str());
+		remove(getWalProgressPath(path).c_str());
+	}
+
+	if (numFolded) {
+		printf("Compacted %d WAL segments in %.2fs\n", numFolded, (getEpochMillis() - startTime) / 1000.0f);
+	}
+}
+
+void walCompactorThread() {
+	std::unique_lock<std::mutex> lock(g_walMutex);
+
+	while (1) {
+		g_walSignal.wait(lock, [] { return g_walCompactPending || g_walStopping; });
+
+		if (g_walStopping) {
+			break;
+		}
+
+		g_walCompactPending = false;
+		foldClosedSegments(g_walSegmentId - 1);
+	}
+}
+
+bool openWalSegment() {
+	uint32_t id = g_walSegmentId + 1;
+	string path = getWalSegmentPath(id);
+
+	errno = 0;
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		printf("Failed to create WAL segment (error %d): %s\n", errno, path.c_str());
+		return false;
+	}
+
+	if (!writeStatHeader(file, walFileMagicBytes, path, WAL_FILE_VERSION) || fflush(file)) {
+		fclose(file);
+		return false;
+	}
+
+	g_walFile = file;
+	g_walSegmentPath = path;
+	g_walSegmentStartTime = getEpochSeconds();
+	g_walSegmentEmpty = true;
+	g_walSegmentId = id;
+
+	return true;
+}
+
+// starts a new segment, and lets the compactor have the old one
+bool rotateWalSegment() {
+	if (g_walSegmentEmpty) {
+		g_walSegmentStartTime = getEpochSeconds();
+		return true;
+	}
+
+	fclose(g_walFile);
+	g_walFile = NULL;
+
+	if (!openWalSegment()) {
+		return false;
+	}
+
+	return true;
+}
+
+bool wal_replay() {
+	if (!dirExists(getWalPath())) {
+		return true;
+	}
+
+	vector<uint32_t> ids = getWalSegmentIds();
+	if (ids.empty()) {
+		return true;
+	}
+
+	printf("Replaying %d WAL segments\n", (int)ids.size());
+	g_walSegmentId = ids[ids.size() - 1];
+
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	foldClosedSegments(g_walSegmentId);
+
+	// live/avg files are regenerated by the compactor after startup
+	g_walLiveStates.clear();
+
+	return true;
+}
+
+bool wal_init() {
+	string walPath = getWalPath();
+
+	if (!dirExists(walPath) && !createDir(walPath)) {
+		printf("Failed to create folder: %s\n", walPath.c_str());
+		return false;
+	}
+
+	if (!openWalSegment()) {
+		return false;
+	}
+
+	g_walStopping = false;
+	g_walCompactPending = false;
+	g_walThread = std::thread(walCompactorThread);
+
+	return true;
+}
+
+void wal_cleanup() {
+	if (!g_walThread.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_walMutex);
+		g_walStopping = true;
+	}
+	g_walSignal.notify_one();
+	g_walThread.join();
+
+	if (g_walFile) {
+		fclose(g_walFile);
+		g_walFile = NULL;
+	}
+
+	g_walLiveStates.clear();
+}
+
+void wal_queue_stat(const string& serverId, const StatSample& stat) {
+	WalStatEntry entry;
+	entry.time = stat.time;
+	entry.players = stat.players;
+	entry.unreachable = stat.unreachable;
+
+	g_walBlock.push_back(serverId.size());
+	g_walBlock.insert(g_walBlock.end(), serverId.begin(), serverId.end());
+	g_walBlock.insert(g_walBlock.end(), (uint8_t*)&entry, (uint8_t*)&entry + sizeof(WalStatEntry));
+}
+
+bool wal_flush() {
+	if (!g_walFile) {
+		return false;
+	}
+
+	bool wroteBlock = false;
+
+	if (g_walBlock.size()) {
+		WalBlockHeader block;
+		block.time = getEpochSeconds();
+		block.size = g_walBlock.size();
+
+		g_walBlock.insert(g_walBlock.begin(), (uint8_t*)&block, (uint8_t*)&block + sizeof(WalBlockHeader));
+
+		errno = 0;
+		if (!fwrite(&g_walBlock[0], g_walBlock.size(), 1, g_walFile) || fflush(g_walFile)) {
+			printf("Failed to write WAL block (error %d): %s\n", errno, g_walSegmentPath.c_str());
+		}
+		else {
+			wroteBlock = true;
+			g_walSegmentEmpty = false;
+		}
+
+		g_walBlock.clear();
+	}
+
+	if (getEpochSeconds() - g_walSegmentStartTime >= WAL_SEGMENT_TIME) {
+		if (rotateWalSegment()) {
+			std::lock_guard<std::mutex> lock(g_walMutex);
+			g_walCompactPending = true;
+		}
+		g_walSignal.notify_one();
+	}
+
+	return wroteBlock;
+}
+
+void wal_compact() {
+	if (!g_walFile) {
+		return;
+	}
+
+	rotateWalSegment();
+
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	g_walCompactPending = false;
+	foldClosedSegments(g_walSegmentId - 1);
+}
+
+void wal_forget_server(const string& serverId) {
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	g_walLiveStates.erase(serverId);
+}
+
+// writes a WAL segment with a single block of stats for one server
+bool writeTestSegment(const string& path, const string& serverId, const vector<StatSample>& stats, uint32_t blockTime) {
+	for (const StatSample& stat : stats) {
+		wal_queue_stat(serverId, stat);
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		printf("Failed to create WAL segment: %s\n", path.c_str());
+		g_walBlock.clear();
+		return false;
+	}
+
+	WalBlockHeader block;
+	block.time = blockTime;
+	block.size = g_walBlock.size();
+	bool written = writeStatHeader(file, walFileMagicBytes, path, WAL_FILE_VERSION)
+		&& fwrite(&block, sizeof(WalBlockHeader), 1, file) && fwrite(&g_walBlock[0], g_walBlock.size(), 1, file);
+	fclose(file);
+	g_walBlock.clear();
+
+	if (!written) {
+		printf("Failed to write WAL segment: %s\n", path.c_str());
+	}
+	return written;
+}
+
+// creates an empty stat file for a test server
+bool createTestServer(ServerState& state, const string& serverId) {
+	state.init();
+	state.addr = serverId;
+	remove(state.getStatFilePath().c_str());
+	remove(state.getLiveStatFilePath().c_str());
+	remove(state.getLiveAvgStatFilePath().c_str());
+	return createServerStatFile(state);
+}
+
+bool sameTestStats(const vector<StatSample>& stats, const vector<StatSample>& expected) {
+	if (stats.size() != expected.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < stats.size(); i++) {
+		if (stats[i].time != expected[i].time || stats[i].unreachable != expected[i].unreachable
+			|| (!stats[i].unreachable && stats[i].players != expected[i].players)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int wal_test() {
+	string testPath = "waltest/";
+	if (!useTestDataPath(testPath)) {
+		return 1;
+	}
+
+	string segmentPath = testPath + "test.wal";
+	string progressPath = getWalProgressPath(segmentPath);
+	remove(progressPath.c_str());
+
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	int failures = 0;
+
+	// an hour of stats, written a minute apart
+	uint32_t startTime = getEpochSeconds() - 60 * 60;
+	vector<StatSample> hourStats;
+	for (int i = 0; i < 60; i++) {
+		StatSample stat;
+		stat.time = startTime + i * 60;
+		stat.players = (i * 7) % 32;
+		stat.unreachable = i == 30;
+		hourStats.push_back(stat);
+	}
+
+	// folding the segment again, as if the program stopped before the segment was deleted
+	ServerState state;
+	if (!createTestServer(state, "10.0.0.1_27015") || !writeTestSegment(segmentPath, state.addr, hourStats, startTime + 60 * 60)) {
+		return 1;
+	}
+
+	foldSegment(segmentPath);
+	vector<uint8_t> statData = readTestFile(state.getStatFilePath());
+	vector<uint8_t> liveData = readTestFile(state.getLiveStatFilePath());
+
+	g_walLiveStates.clear();
+	foldSegment(segmentPath);
+	vector<uint8_t> replayedStatData = readTestFile(state.getStatFilePath());
+	vector<uint8_t> replayedLiveData = readTestFile(state.getLiveStatFilePath());
+	remove(progressPath.c_str());
+
+	if (statData.size() <= sizeof(StatFileHeader) || statData != replayedStatData) {
+		printf("FAIL: stat file changed when the segment was folded again (%d -> %d bytes)\n",
+			(int)statData.size(), (int)replayedStatData.size());
+		failures++;
+	}
+	else if (liveData != replayedLiveData) {
+		printf("FAIL: live file changed when the segment was folded again (%d -> %d bytes)\n",
+			(int)liveData.size(), (int)replayedLiveData.size());
+		failures++;
+	}
+	else {
+		printf("PASS: folding a WAL segment again left the stat files unchanged (%d bytes)\n", (int)statData.size());
+	}
+
+	// the program stopped after some of the server's stats were appended
+	ServerState partialState;
+	if (!createTestServer(partialState, "10.0.0.1_27016") || !writeTestSegment(segmentPath, partialState.addr, hourStats, startTime + 60 * 60)) {
+		return 1;
+	}
+
+	StatBlockWriter writer;
+	FILE* progressFile = fopen(progressPath.c_str(), "wb");
+	bool written = progressFile && openStatWriter(partialState, writer)
+		&& writeStatHeader(progressFile, walProgressMagicBytes, progressPath, WAL_FILE_VERSION)
+		&& writeFoldProgress(progressFile, partialState.addr, writer.position());
+	for (int i = 0; i < 20; i++) {
+		written = written && writer.append(hourStats[i]);
+	}
+	written = written && writer.flush();
+	writer.close();
+	if (progressFile) {
+		fclose(progressFile);
+	}
+	if (!written) {
+		printf("Failed to write a partially folded segment\n");
+		return 1;
+	}
+
+	g_walLiveStates.clear();
+	foldSegment(segmentPath);
+	remove(progressPath.c_str());
+
+	vector<StatSample> partialStats = readTestStats(partialState);
+	if (!sameTestStats(partialStats, hourStats)) {
+		printf("FAIL: replaying a partially folded segment left %d stats instead of %d\n",
+			(int)partialStats.size(), (int)hourStats.size());
+		failures++;
+	}
+	else {
+		printf("PASS: replaying a partially folded segment appended only the missing stats\n");
+	}
+
+	// the unreachable stat written after a restart has the same time as the last stat in the file
+	ServerState restartState;
+	if (!createTestServer(restartState, "10.0.0.1_27017") || !openStatWriter(restartState, writer)) {
+		return 1;
+	}
+
+	vector<StatSample> restartStats(3);
+	restartStats[0].time = startTime;
+	restartStats[0].players = 5;
+	restartStats[0].unreachable = false;
+	restartStats[1].time = startTime;
+	restartStats[1].players = 0;
+	restartStats[1].unreachable = true;
+	restartStats[2].time = startTime + 60;
+	restartStats[2].players = 3;
+	restartStats[2].unreachable = false;
+
+	written = writer.append(restartStats[0]) && writer.flush();
+	writer.close();
+	vector<StatSample> segmentStats(restartStats.begin() + 1, restartStats.end());
+	if (!written || !writeTestSegment(segmentPath, restartState.addr, segmentStats, startTime + 60)) {
+		return 1;
+	}
+
+	g_walLiveStates.clear();
+	foldSegment(segmentPath);
+	remove(progressPath.c_str());
+
+	vector<StatSample> foldedStats = readTestStats(restartState);
+	if (!sameTestStats(foldedStats, restartStats)) {
+		printf("FAIL: a WAL stat with the same time as the last stat in the file was dropped (%d stats instead of %d)\n",
+			(int)foldedStats.size(), (int)restartStats.size());
+		failures++;
+	}
+	else {
+		printf("PASS: a WAL stat with the same time as the last stat in the file was folded\n");
+	}
+
+	g_walLiveStates.clear();
+	remove(segmentPath.c_str());
+	return failures ? 1 : 0;
+}
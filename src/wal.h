@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include "statfile.h"
+
+// Write-ahead log for player count stats. Each tick appends a single block of stats for all servers
+// to a WAL segment, and a background thread folds finished segments into the per-server stat files.
+
+// fold any WAL segments left behind by a previous run into the stat files
+bool wal_replay();
+
+// open a new WAL segment and start the compactor thread
+bool wal_init();
+
+// stop the compactor thread. Unfinished segments are replayed on the next startup.
+void wal_cleanup();
+
+// queue a stat for the current tick's block
+void wal_queue_stat(const std::string& serverId, const StatSample& stat);
+
+// append the current tick's block to the WAL. Returns true if anything was written.
+bool wal_flush();
+
+// fold all WAL stats into the stat files now
+void wal_compact();
+
+// drop cached live/avg state for a server that's being archived or deleted
+void wal_forget_server(const std::string& serverId);
+
+// checks that folding a segment again, as happens when the program stops before the segment is deleted,
+// doesn't change the stat files. Returns 0 if it passed.
+int wal_test();